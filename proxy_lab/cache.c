@@ -1,185 +1,1103 @@
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#include "proxy.h"
-
-typedef struct cache_node {
-    char *key;  // The key (e.g., URL)
-    void *data; // The data associated with the key (e.g., HTML content)
-    int size;   // Size of the data
-    struct cache_node *prev; // Pointer to the previous node in the linked list
-    struct cache_node *next; // Pointer to the next node in the linked list
-} cache_node_t;
-
-typedef struct {
-    cache_node_t *head; // Pointer to the head of the doubly linked list (most
-                        // recently used)
-    cache_node_t *tail; // Pointer to the tail of the doubly linked list (least
-                        // recently used)
-    int current_size;   // Current total size of all cached objects
-    pthread_mutex_t lock; // Mutex lock for thread-safe operations
-} cache_t;
-
-// Hash Table (Simple Array for Example)
-#define HASH_TABLE_SIZE 997
-cache_node_t *hash_table[HASH_TABLE_SIZE];
+#include "cache.h"
+#include "disk_cache.h"
+#include "engine_common.h"
+#include "slab.h"
+#include "stats.h"
 
 // Cache
 cache_t cache;
 
-// Simple hash function for demo purposes
-unsigned int hash(const char *str) {
-    unsigned int hash = 0;
-    while (*str) {
-        hash = (hash * 31 + *str++) % HASH_TABLE_SIZE;
+// Eviction policy and TinyLFU admission, fixed before init_cache()
+static const cache_policy_t *policy;
+static bool admission;
+
+// Hit ratio counters, see cache_count()
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// String hash in the style of wyhash: consumes the key 8 bytes at a time and
+// mixes with a folded multiply, which is much faster than a per-character
+// loop and spreads URLs sharing long prefixes well.
+uint64_t hash(const char *str) {
+    const uint64_t p0 = 0xa0761d6478bd642fULL;
+    const uint64_t p1 = 0xe7037ed1a0b428dbULL;
+    const uint64_t p2 = 0x8ebc6af09c88c6e3ULL;
+    size_t len = strlen(str);
+    uint64_t h = p0 ^ (len * p1);
+    uint64_t w;
+
+    while (len >= 8) {
+        memcpy(&w, str, 8);
+        h = hash_mix(h ^ w, p1);
+        str += 8;
+        len -= 8;
     }
-    return hash;
+    w = 0;
+    memcpy(&w, str, len);
+    h = hash_mix(h ^ w, p2 ^ len);
+    return hash_mix(h, p0);
 }
 
-// Function to remove a cache node
-void remove_cache_node(cache_node_t *node) {
-    if (node == NULL)
+// Pick the shard owning a key. The high bits are used so that shard selection
+// stays independent of the bucket index inside the shard.
+static cache_shard_t *get_shard(uint64_t h) {
+    return &cache.shards[(h >> 32) % CACHE_SHARDS];
+}
+
+// Find a node in the shard's hash table, caller holds shard->lock
+static cache_node_t *lookup_node(cache_shard_t *shard, const char *key,
+                                 uint64_t h) {
+    cache_node_t *node = shard->buckets[h & (shard->nbuckets - 1)];
+    while (node != NULL) {
+        if (node->hash == h && strcmp(node->key, key) == 0)
+            return node;
+        node = node->hnext;
+    }
+    return NULL;
+}
+
+// Double the bucket array once the load factor passes 3/4. Hashes are stored
+// in the nodes, so rehashing does not touch the keys. On allocation failure
+// the old table is kept and simply runs at a higher load.
+static void grow_table(cache_shard_t *shard) {
+    if (shard->count * 4 <= shard->nbuckets * 3)
         return;
 
-    // Remove node from linked list
-    if (node->prev) {
-        node->prev->next = node->next;
-    } else {
-        cache.head = node->next;
+    size_t nbuckets = shard->nbuckets * 2;
+    cache_node_t **buckets = calloc(nbuckets, sizeof(cache_node_t *));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < shard->nbuckets; i++) {
+        cache_node_t *node = shard->buckets[i];
+        while (node != NULL) {
+            cache_node_t *hnext = node->hnext;
+            size_t index = node->hash & (nbuckets - 1);
+            node->hnext = buckets[index];
+            buckets[index] = node;
+            node = hnext;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+// Allocate a node for size bytes of data under key. The node and the key
+// share one slab block; the data gets its own segments.
+static cache_node_t *alloc_node(const char *key, size_t size) {
+    size_t keylen = strlen(key) + 1;
+    cache_node_t *node = slab_alloc(sizeof(cache_node_t) + keylen);
+    if (node == NULL)
+        return NULL;
+    node->data = (segbuf_t){NULL, 0, 0};
+    if (!segbuf_reserve(&node->data, size)) {
+        segbuf_free(&node->data);
+        slab_free(node);
+        return NULL;
+    }
+    node->data.len = size;
+    node->key = (char *)(node + 1);
+    memcpy(node->key, key, keylen);
+    node->size = size;
+    node->hash = hash(key);
+    node->shard = get_shard(node->hash);
+    node->evicted = false;
+    node->map = NULL;
+    return node;
+}
+
+// Find the validators of a complete node in its stored head, which starts
+// in the first segment, and set its expiry: expires if it was kept with the
+// node, or -1 to work it out from the head. A node without a parsable head
+// gets the default lifetime and no validators. Returns false if the head
+// forbids storing the response.
+static bool read_node_meta(cache_node_t *node, time_t expires) {
+    resp_meta_t meta;
+    size_t len = node->size < SEGMENT_SIZE ? node->size : SEGMENT_SIZE;
+    if (len == 0 || !response_meta_parse(node->data.segs[0], len, &meta)) {
+        meta.etag_len = meta.last_modified_len = 0;
+        response_fresh_init(&meta.fresh);
     }
-    if (node->next) {
-        node->next->prev = node->prev;
+    if (expires < 0)
+        expires = response_expiry(&meta.fresh, time(NULL));
+    atomic_init(&node->expires, expires);
+    node->etag = meta.etag_len > 0 ? meta.etag : NULL;
+    node->etag_len = meta.etag_len;
+    node->last_modified = meta.last_modified_len > 0 ? meta.last_modified
+                                                     : NULL;
+    node->last_modified_len = meta.last_modified_len;
+    return !meta.fresh.no_store;
+}
+
+// Free a node once no reference to it is left
+static void free_cache_node(cache_node_t *node) {
+    if (node->map != NULL) {
+        // The segments point into the mapping
+        free(node->data.segs);
+        munmap(node->map, node->maplen);
     } else {
-        cache.tail = node->prev;
+        segbuf_free(&node->data);
+    }
+    slab_free(node);
+}
+
+// Evicted nodes waiting for the spill thread, which writes them to the disk
+// tier so that request threads never wait on the disk
+static struct {
+    cache_node_t *head; // Oldest queued node, linked through next
+    cache_node_t *tail;
+    size_t bytes;       // Data bytes queued, at most SPILL_QUEUE_BYTES
+    bool started;       // The thread is running
+    bool stop;          // free_cache() is waiting for the queue to drain
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // Signalled when a node is queued or stop is set
+} spill = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .cond = PTHREAD_COND_INITIALIZER};
+
+// Whether key is cached in memory, in which case a spilled copy would only
+// be stale or redundant
+static bool in_memory(const char *key, uint64_t h) {
+    cache_shard_t *shard = get_shard(h);
+    pthread_mutex_lock(&shard->lock);
+    bool found = lookup_node(shard, key, h) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+static void *spill_loop(void *vargp) {
+    (void)vargp;
+    pthread_mutex_lock(&spill.lock);
+    while (true) {
+        while (spill.head == NULL && !spill.stop) {
+            pthread_cond_wait(&spill.cond, &spill.lock);
+        }
+        cache_node_t *node = spill.head;
+        if (node == NULL)
+            break;
+        spill.head = node->next;
+        if (spill.head == NULL)
+            spill.tail = NULL;
+        pthread_mutex_unlock(&spill.lock);
+
+        if (!in_memory(node->key, node->hash))
+            disk_cache_store(node->key, &node->data,
+                             atomic_load(&node->expires), node->disk_gen);
+        size_t size = node->size;
+        free_cache_node(node);
+
+        pthread_mutex_lock(&spill.lock);
+        spill.bytes -= size;
     }
+    pthread_mutex_unlock(&spill.lock);
+    return NULL;
+}
 
-    // Remove node from hash table
-    unsigned int index = hash(node->key);
-    if (hash_table[index] == node) {
-        hash_table[index] = NULL;
+// Free an evicted node, handing it to the spill thread first if the disk
+// tier is on. The thread is started on the first spill; if it cannot be,
+// nodes are written synchronously instead.
+static void spill_node(cache_node_t *node) {
+    if (!disk_cache_enabled()) {
+        free_cache_node(node);
+        return;
     }
 
-    // Update current cache size
-    cache.current_size -= node->size;
+    pthread_mutex_lock(&spill.lock);
+    if (!spill.started && !spill.stop) {
+        // The thread never handles signals, whatever the proxy blocks later
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        spill.started =
+            pthread_create(&spill.thread, NULL, spill_loop, NULL) == 0;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    bool queued = false;
+    if (spill.started && !spill.stop &&
+        spill.bytes + node->size <= SPILL_QUEUE_BYTES) {
+        node->next = NULL;
+        if (spill.tail != NULL)
+            spill.tail->next = node;
+        else
+            spill.head = node;
+        spill.tail = node;
+        spill.bytes += node->size;
+        pthread_cond_signal(&spill.cond);
+        queued = true;
+    }
+    bool sync = !spill.started;
+    pthread_mutex_unlock(&spill.lock);
 
-    // Free memory
-    free(node->key);
-    free(node->data);
-    free(node);
+    if (queued)
+        return;
+    if (sync)
+        disk_cache_store(node->key, &node->data, atomic_load(&node->expires),
+                         node->disk_gen);
+    free_cache_node(node);
 }
 
-// Function to add a new cache node
-void add_cache_node(const char *key, const void *data, int size) {
-    pthread_mutex_lock(&cache.lock);
+// Write out the spill queue and stop the spill thread
+static void spill_drain(void) {
+    pthread_mutex_lock(&spill.lock);
+    spill.stop = true;
+    pthread_cond_signal(&spill.cond);
+    bool started = spill.started;
+    pthread_mutex_unlock(&spill.lock);
+    if (started)
+        pthread_join(spill.thread, NULL);
+}
 
-    if (size > MAX_OBJECT_SIZE) {
-        // Object too large to be cached
-        pthread_mutex_unlock(&cache.lock);
+// Function to remove a cache node, caller holds shard->lock. The cache's
+// reference is dropped; if a reader still has the node pinned its bytes stay
+// charged to the shard as pinned_size until put_cache_node() frees it.
+// Otherwise the node is pushed onto *victims to be freed after unlocking.
+// Evicted nodes are spilled to the disk tier when freed; replaced ones are
+// stale and are not.
+static void remove_cache_node(cache_shard_t *shard, cache_node_t *node,
+                              cache_node_t **victims, bool evicted) {
+    if (node == NULL)
         return;
+    node->evicted = evicted;
+    if (evicted) {
+        // Before the node leaves the table: a later add removes the key
+        // from disk, which the spill then notices
+        node->disk_gen = disk_cache_generation(node->hash);
+        stats_add(STAT_EVICTIONS, 1);
     }
 
-    // If cache is full, remove least recently used nodes until there's enough
-    // space
-    while (cache.current_size + size > MAX_CACHE_SIZE) {
-        remove_cache_node(cache.tail);
+    // Remove node from the policy's lists
+    policy->remove(shard, node);
+
+    // Remove node from its hash chain
+    cache_node_t **link = &shard->buckets[node->hash & (shard->nbuckets - 1)];
+    while (*link != node) {
+        link = &(*link)->hnext;
     }
+    *link = node->hnext;
+    shard->count--;
 
-    // Create new cache node
-    cache_node_t *new_node = (cache_node_t *)malloc(sizeof(cache_node_t));
-    new_node->key = strdup(key);
-    new_node->data = malloc(size);
-    memcpy(new_node->data, data, size);
-    new_node->size = size;
+    // Update current shard size
+    shard->current_size -= node->size;
+
+    // Drop the cache's reference
+    if (atomic_fetch_sub(&node->refcnt, 1) == 1) {
+        node->next = *victims;
+        *victims = node;
+    } else {
+        shard->pinned_size += node->size;
+    }
+}
+
+// Free the nodes evicted during one critical section
+static void free_victims(cache_node_t *victims) {
+    while (victims != NULL) {
+        cache_node_t *next = victims->next;
+        if (victims->evicted)
+            spill_node(victims);
+        else
+            free_cache_node(victims);
+        victims = next;
+    }
+}
+
+// Insert a node from alloc_node(), stale from expires, or -1 to read its
+// lifetime from its head. On success the node is returned pinned for the
+// caller. Otherwise NULL is returned and the node still belongs to the
+// caller.
+static cache_node_t *insert_node(cache_node_t *new_node, time_t expires) {
+    size_t size = new_node->size;
+    if (size > max_object_size) {
+        // Object too large to be cached
+        return NULL;
+    }
+    atomic_init(&new_node->refcnt, 2);
     new_node->prev = NULL;
-    new_node->next = cache.head;
+    bool storable = read_node_meta(new_node, expires);
+
+    uint64_t h = new_node->hash;
+    cache_shard_t *shard = new_node->shard;
+    cache_node_t *victims = NULL;
+    pthread_mutex_lock(&shard->lock);
+
+    // A newer copy replaces any node already cached under the same key
+    cache_node_t *old = lookup_node(shard, new_node->key, h);
+    remove_cache_node(shard, old, &victims, false);
+    if (!storable) {
+        // Cache-Control: no-store, the old copy is dropped all the same
+        pthread_mutex_unlock(&shard->lock);
+        free_victims(victims);
+        return NULL;
+    }
+
+    // TinyLFU admission: a new key only displaces nodes if it has been
+    // requested more often than the policy's next victim
+    if (admission && old == NULL &&
+        shard->current_size + shard->pinned_size + size > shard->max_size) {
+        cache_node_t *victim = policy->peek(shard);
+        if (victim != NULL &&
+            sketch_estimate(&shard->sketch, h) <=
+                sketch_estimate(&shard->sketch, victim->hash)) {
+            pthread_mutex_unlock(&shard->lock);
+            free_victims(victims);
+            return NULL;
+        }
+    }
 
-    // Insert new node at the head of the list (most recently used)
-    if (cache.head) {
-        cache.head->prev = new_node;
+    // If the shard is full, remove the policy's victims until there's
+    // enough space. Pinned bytes still count against the budget.
+    cache_node_t *victim;
+    while (shard->current_size + shard->pinned_size + size > shard->max_size &&
+           (victim = policy->victim(shard)) != NULL) {
+        remove_cache_node(shard, victim, &victims, true);
+    }
+    if (shard->current_size + shard->pinned_size + size > shard->max_size) {
+        // Readers pin too much of the shard right now, skip caching
+        pthread_mutex_unlock(&shard->lock);
+        free_victims(victims);
+        return NULL;
     }
-    cache.head = new_node;
-    if (!cache.tail) {
-        cache.tail = new_node;
+
+    // Hand the new node to the policy
+    if (!policy->insert(shard, new_node)) {
+        pthread_mutex_unlock(&shard->lock);
+        free_victims(victims);
+        return NULL;
     }
 
     // Add node to hash table
-    unsigned int index = hash(key);
-    hash_table[index] = new_node;
+    size_t index = h & (shard->nbuckets - 1);
+    new_node->hnext = shard->buckets[index];
+    shard->buckets[index] = new_node;
+    shard->count++;
+    grow_table(shard);
 
-    // Update current cache size
-    cache.current_size += size;
+    // Update current shard size
+    shard->current_size += size;
 
-    // Unlock the cache
-    pthread_mutex_unlock(&cache.lock);
+    // Unlock the shard, then release evicted memory
+    pthread_mutex_unlock(&shard->lock);
+    free_victims(victims);
+    return new_node;
 }
 
-// Function to get a cache node by key
-int get_cache_node(const char *key, void **data, int *size) {
-    // Lock the cache for thread safety
-    pthread_mutex_lock(&cache.lock);
+// Function to add a new cache node. The node takes over the segments of
+// data, which is left empty, so the object is not copied. Returns whether
+// the object was cached; the cache may refuse it, e.g. for no-store.
+bool add_cache_node(const char *key, segbuf_t *data) {
+    if (data->len > max_object_size) {
+        return false;
+    }
 
-    unsigned int index = hash(key);
-    cache_node_t *node = hash_table[index];
-    if (node == NULL || strcmp(node->key, key) != 0) {
-        // Key not found
-        pthread_mutex_unlock(&cache.lock);
-        return -1;
+    // Build the node before taking the lock
+    cache_node_t *new_node = alloc_node(key, 0);
+    if (new_node == NULL)
+        return false;
+    new_node->data = *data;
+    new_node->size = data->len;
+    *data = (segbuf_t){NULL, 0, 0};
+
+    // A fresh copy makes any spilled one stale, including one still being
+    // written; removing after the insert also catches copies evicted since
+    cache_node_t *node = insert_node(new_node, -1);
+    disk_cache_remove(key);
+    if (node != NULL)
+        put_cache_node(node);
+    else
+        free_cache_node(new_node);
+    return node != NULL;
+}
+
+// Find a node and report the access to the policy, caller holds
+// shard->lock. Misses are counted too, for TinyLFU admission.
+static cache_node_t *touch_node(cache_shard_t *shard, const char *key,
+                                uint64_t h) {
+    if (admission)
+        sketch_add(&shard->sketch, h);
+    cache_node_t *node = lookup_node(shard, key, h);
+    if (node != NULL)
+        policy->hit(shard, node);
+    return node;
+}
+
+// Wrap a disk object in a node that is not cached: its segments point into
+// the mapping, so the object is served from the page cache without a copy.
+// The node is returned with a single reference, and put_cache_node() unmaps
+// it. Returns NULL, with the object closed, if memory ran out.
+static cache_node_t *map_node(const char *key, disk_object_t *obj) {
+    size_t nsegs = (obj->size + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT;
+    cache_node_t *node = alloc_node(key, 0);
+    char **segs = malloc((nsegs > 0 ? nsegs : 1) * sizeof(char *));
+    if (node == NULL || segs == NULL) {
+        if (node != NULL)
+            free_cache_node(node);
+        free(segs);
+        disk_cache_close(obj);
+        return NULL;
+    }
+    for (size_t i = 0; i < nsegs; i++) {
+        segs[i] = (char *)obj->data + (i << SEGMENT_SHIFT);
     }
+    node->data = (segbuf_t){segs, nsegs, obj->size};
+    node->size = obj->size;
+    node->map = obj->map;
+    node->maplen = obj->maplen;
+    atomic_init(&node->refcnt, 1);
+    read_node_meta(node, obj->expires);
+    return node;
+}
 
-    // Move accessed node to the head of the list (most recently used)
-    if (node != cache.head) {
-        // Remove node from its current position
-        if (node->prev) {
-            node->prev->next = node->next;
+// Promote an object from the disk tier back into memory. Returns the new
+// node pinned, or NULL if the key is not on disk. An object that memory
+// does not take is served from its mapping instead.
+static cache_node_t *promote_node(const char *key) {
+    disk_object_t obj;
+    if (!disk_cache_open(key, &obj))
+        return NULL;
+    cache_node_t *new_node = alloc_node(key, obj.size);
+    if (new_node != NULL) {
+        segbuf_write(&new_node->data, 0, obj.data, obj.size);
+        cache_node_t *node = insert_node(new_node, obj.expires);
+        if (node != NULL) {
+            disk_cache_close(&obj);
+            return node;
         }
-        if (node->next) {
-            node->next->prev = node->prev;
+        free_cache_node(new_node);
+    }
+    return map_node(key, &obj);
+}
+
+// Function to get a cache node by key. On a hit the node is returned pinned,
+// so node->data stays valid without the lock until put_cache_node().
+cache_node_t *get_cache_node(const char *key) {
+    uint64_t h = hash(key);
+    cache_shard_t *shard = get_shard(h);
+
+    // Lock only the owning shard for thread safety
+    pthread_mutex_lock(&shard->lock);
+
+    cache_node_t *node = touch_node(shard, key, h);
+    if (node == NULL) {
+        // Key not in memory, try the disk tier
+        pthread_mutex_unlock(&shard->lock);
+        return promote_node(key);
+    }
+
+    // Pin the node for the caller, then unlock the shard
+    atomic_fetch_add(&node->refcnt, 1);
+    pthread_mutex_unlock(&shard->lock);
+
+    return node;
+}
+
+// Find the in-flight fetch of a key, caller holds shard->lock
+static flight_t **lookup_flight(cache_shard_t *shard, const char *key,
+                                uint64_t h) {
+    flight_t **link = &shard->flights[h & (FLIGHT_BUCKETS - 1)];
+    while (*link != NULL) {
+        if ((*link)->hash == h && strcmp((*link)->key, key) == 0)
+            break;
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Free a flight once its last reference is gone. Its fill is freed unless
+// it became the cached node.
+static void free_flight(flight_t *flight) {
+    if (flight->node == NULL && flight->fill != NULL)
+        free_cache_node(flight->fill);
+    pthread_cond_destroy(&flight->cond);
+    free(flight->key);
+    free(flight);
+}
+
+// Look up a key, coalescing concurrent misses:
+//   CACHE_HIT   *node is set and pinned, release it with put_cache_node().
+//   CACHE_FETCH no fetch was in progress; *flight is set and the caller
+//               fetches the object, publishes it with flight_begin_fill() /
+//               flight_append() and must end with flight_finish().
+//   CACHE_JOIN  another request is filling the object; *flight is set and the
+//               caller streams it with flight_wait(), then flight_leave().
+//   CACHE_MISS  the fetch that was waited on produced nothing to share, so
+//               the caller fetches on its own.
+// A joiner blocks only until the fetcher has published the response head.
+cache_lookup_t cache_lookup(const char *key, cache_node_t **node,
+                            flight_t **flight) {
+    uint64_t h = hash(key);
+    cache_shard_t *shard = get_shard(h);
+    *node = NULL;
+    *flight = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    cache_node_t *hit = touch_node(shard, key, h);
+    if (hit != NULL) {
+        atomic_fetch_add(&hit->refcnt, 1);
+        pthread_mutex_unlock(&shard->lock);
+        *node = hit;
+        return CACHE_HIT;
+    }
+
+    flight_t **link = lookup_flight(shard, key, h);
+    if (*link == NULL && disk_cache_enabled()) {
+        // Try the disk tier before fetching, then look again: the key may
+        // have been cached or started fetching meanwhile
+        pthread_mutex_unlock(&shard->lock);
+        if ((hit = promote_node(key)) != NULL) {
+            *node = hit;
+            return CACHE_HIT;
         }
-        if (node == cache.tail) {
-            cache.tail = node->prev;
+        // The access is in the sketch already, only the policy sees it
+        pthread_mutex_lock(&shard->lock);
+        if ((hit = lookup_node(shard, key, h)) != NULL) {
+            policy->hit(shard, hit);
+            atomic_fetch_add(&hit->refcnt, 1);
+            pthread_mutex_unlock(&shard->lock);
+            *node = hit;
+            return CACHE_HIT;
         }
-
-        // Move node to the head of the list
-        node->next = cache.head;
-        node->prev = NULL;
-        if (cache.head) {
-            cache.head->prev = node;
+        link = lookup_flight(shard, key, h);
+    }
+    flight_t *f = *link;
+    if (f == NULL) {
+        // First miss: become the fetcher. Without memory, fetch uncoalesced.
+        f = calloc(1, sizeof(flight_t));
+        if (f != NULL && (f->key = strdup(key)) == NULL) {
+            free(f);
+            f = NULL;
+        }
+        if (f != NULL) {
+            f->hash = h;
+            f->refs = 1;
+            pthread_cond_init(&f->cond, NULL);
+            *link = f;
         }
-        cache.head = node;
+        pthread_mutex_unlock(&shard->lock);
+        *flight = f;
+        return f != NULL ? CACHE_FETCH : CACHE_MISS;
     }
 
-    // Unlock the cache
-    *size = node->size;
-    *data = node->data;
-    pthread_mutex_unlock(&cache.lock);
+    // Wait for the head. The fetcher pins its result once for every waiter.
+    f->refs++;
+    while (!f->done && f->fill == NULL) {
+        pthread_cond_wait(&f->cond, &shard->lock);
+    }
+    if (f->done && f->node != NULL) {
+        *node = f->node;
+        bool last = --f->refs == 0;
+        pthread_mutex_unlock(&shard->lock);
+        if (last)
+            free_flight(f);
+        return CACHE_HIT;
+    }
+    if (f->fill != NULL && !f->failed) {
+        pthread_mutex_unlock(&shard->lock);
+        *flight = f;
+        return CACHE_JOIN;
+    }
+    bool last = --f->refs == 0;
+    pthread_mutex_unlock(&shard->lock);
+    if (last)
+        free_flight(f);
+    return CACHE_MISS;
+}
+
+// Publish the response head of a fetch whose object will be size bytes, so
+// joiners can start sending. The node that will be cached takes over the
+// segments of head, leaving it empty, and the rest of the object is filled
+// in straight after it. Returns false if no room could be allocated, in
+// which case head keeps its data and the fetch goes on unshared.
+bool flight_begin_fill(flight_t *flight, segbuf_t *head, size_t size) {
+    cache_node_t *fill = alloc_node(flight->key, 0);
+    if (fill == NULL)
+        return false;
+    size_t head_len = head->len;
+    if (!segbuf_reserve(head, size)) {
+        free_cache_node(fill);
+        return false;
+    }
+    fill->data = *head;
+    fill->data.len = size;
+    fill->size = size;
+    *head = (segbuf_t){NULL, 0, 0};
+
+    cache_shard_t *shard = get_shard(flight->hash);
+    pthread_mutex_lock(&shard->lock);
+    flight->fill = fill;
+    flight->head_len = head_len;
+    flight->size = size;
+    flight->filled = head_len;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+// Append body bytes to a filling object. Only the fetcher writes past
+// flight->filled, so the copy is done without the lock.
+void flight_append(flight_t *flight, const void *buf, size_t n) {
+    if (n > flight->size - flight->filled)
+        n = flight->size - flight->filled;
+    segbuf_write(&flight->fill->data, flight->filled, buf, n);
+
+    cache_shard_t *shard = get_shard(flight->hash);
+    pthread_mutex_lock(&shard->lock);
+    flight->filled += n;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Finish a fetch started by cache_lookup(). A complete fill is inserted into
+// the cache and its node handed to the waiters; otherwise joiners see the
+// stream end early and waiters for the head fetch on their own. Returns
+// whether the object was cached.
+bool flight_finish(flight_t *flight, bool complete) {
+    complete = complete && flight->fill != NULL &&
+               flight->filled == flight->size;
+    // Insert first, so new requests hit the cache once the flight is gone,
+    // then drop the spilled copy the fill replaces, as in add_cache_node()
+    cache_node_t *node = complete ? insert_node(flight->fill, -1) : NULL;
+    if (complete)
+        disk_cache_remove(flight->key);
+    cache_shard_t *shard = get_shard(flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    flight_t **link = lookup_flight(shard, flight->key, flight->hash);
+    *link = flight->next;
+    flight->done = true;
+    flight->failed = !complete;
+    flight->node = node;
+    if (node != NULL && flight->refs > 1) {
+        atomic_fetch_add(&node->refcnt, flight->refs - 1);
+    }
+    bool last = --flight->refs == 0;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&shard->lock);
 
+    if (node != NULL)
+        put_cache_node(node);
+    if (last)
+        free_flight(flight);
+    return node != NULL;
+}
+
+// Wait until a filling object has more than offset bytes. Returns how many
+// bytes of flight->fill->data are readable, or -1 if the fetch failed first.
+ssize_t flight_wait(flight_t *flight, size_t offset) {
+    cache_shard_t *shard = get_shard(flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    while (flight->filled <= offset && !flight->done) {
+        pthread_cond_wait(&flight->cond, &shard->lock);
+    }
+    ssize_t filled = flight->filled > offset ? (ssize_t)flight->filled : -1;
+    pthread_mutex_unlock(&shard->lock);
+    return filled;
+}
+
+// Drop a joiner's reference to a flight
+void flight_leave(flight_t *flight) {
+    cache_shard_t *shard = get_shard(flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    cache_node_t *node = flight->done ? flight->node : NULL;
+    bool last = --flight->refs == 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (node != NULL)
+        put_cache_node(node);
+    if (last)
+        free_flight(flight);
+}
+
+// Release a node returned by get_cache_node(). If the node was evicted while
+// pinned, the last reader frees it and returns its bytes to the shard.
+void put_cache_node(cache_node_t *node) {
+    if (atomic_fetch_sub(&node->refcnt, 1) != 1)
+        return;
+    if (node->map != NULL) {
+        // Served from disk, never charged to the shard
+        free_cache_node(node);
+        return;
+    }
+
+    cache_shard_t *shard = node->shard;
+    pthread_mutex_lock(&shard->lock);
+    shard->pinned_size -= node->size;
+    pthread_mutex_unlock(&shard->lock);
+    if (node->evicted)
+        spill_node(node);
+    else
+        free_cache_node(node);
+}
+
+// Whether a cached response may still be served without asking the origin
+bool cache_node_fresh(const cache_node_t *node) {
+    return time(NULL) <
+           atomic_load_explicit(&node->expires, memory_order_relaxed);
+}
+
+// Extend a node's lifetime after the origin confirmed it is current
+void cache_node_refresh(cache_node_t *node, time_t expires) {
+    atomic_store_explicit(&node->expires, expires, memory_order_relaxed);
+}
+
+// Count a cacheable request of bytes response bytes, served from the cache
+// or not. Callers count hits when they serve them and misses once the size
+// of the fetched response is known.
+void cache_count(bool hit, long long bytes) {
+    stats_add(hit ? STAT_HITS : STAT_MISSES, 1);
+    stats_add(STAT_BYTES, bytes);
+    if (hit) {
+        stats_add(STAT_HIT_BYTES, bytes);
+    }
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+    stats->hits = stats_get(STAT_HITS);
+    stats->requests = stats->hits + stats_get(STAT_MISSES);
+    stats->bytes = stats_get(STAT_BYTES);
+    stats->hit_bytes = stats_get(STAT_HIT_BYTES);
+}
+
+// Select the eviction policy by name and whether TinyLFU admission filters
+// inserts. Call before init_cache(). Returns -1 for an unknown policy.
+int cache_set_policy(const char *name, bool admit) {
+    const cache_policy_t *p = cache_policy_find(name);
+    if (p == NULL)
+        return -1;
+    policy = p;
+    admission = admit;
     return 0;
 }
 
 // Initialize cache
 void init_cache() {
-    cache.head = NULL;
-    cache.tail = NULL;
-    cache.current_size = 0;
-    pthread_mutex_init(&cache.lock, NULL);
-    memset(hash_table, 0, sizeof(hash_table));
+    if (policy == NULL)
+        policy = cache_policy_find("lru");
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache.shards[i];
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->hand = NULL;
+        shard->small_head = NULL;
+        shard->small_tail = NULL;
+        shard->small_size = 0;
+        memset(&shard->ghost, 0, sizeof(shard->ghost));
+        memset(&shard->sketch, 0, sizeof(shard->sketch));
+        shard->heap = NULL;
+        shard->heap_len = 0;
+        shard->heap_cap = 0;
+        shard->inflation = 0;
+        shard->current_size = 0;
+        shard->pinned_size = 0;
+        shard->max_size = max_cache_size / CACHE_SHARDS;
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = calloc(CACHE_INIT_BUCKETS, sizeof(cache_node_t *));
+        if (shard->buckets == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        shard->nbuckets = CACHE_INIT_BUCKETS;
+        shard->count = 0;
+        memset(shard->flights, 0, sizeof(shard->flights));
+    }
 }
 
 // Free all cache nodes
 void free_cache() {
-    pthread_mutex_lock(&cache.lock);
-    cache_node_t *current = cache.head;
-    while (current != NULL) {
-        cache_node_t *next = current->next;
-        free(current->key);
-        free(current->data);
-        free(current);
-        current = next;
-    }
-    pthread_mutex_unlock(&cache.lock);
-    pthread_mutex_destroy(&cache.lock);
+    spill_drain();
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t b = 0; b < shard->nbuckets; b++) {
+            cache_node_t *current = shard->buckets[b];
+            while (current != NULL) {
+                cache_node_t *next = current->hnext;
+                free_cache_node(current);
+                current = next;
+            }
+        }
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->hand = NULL;
+        shard->small_head = NULL;
+        shard->small_tail = NULL;
+        shard->small_size = 0;
+        free(shard->heap);
+        shard->heap = NULL;
+        shard->heap_len = 0;
+        shard->heap_cap = 0;
+        shard->current_size = 0;
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->nbuckets = 0;
+        shard->count = 0;
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    slab_trim();
+    segment_trim();
+}
+
+// Snapshot file layout: a header, then for each shard its policy state and
+// its nodes oldest first, each as an entry header, the key with its NUL and
+// the data. Fields are in host byte order; a snapshot is only read back by
+// the same build on the same machine.
+#define SNAPSHOT_MAGIC "PXSNAP03"
+
+typedef struct {
+    char magic[8];
+    char policy[16]; // Policy the metadata below belongs to
+    uint32_t shards; // CACHE_SHARDS when saved
+} snap_header_t;
+
+typedef struct {
+    uint64_t count;   // Entries that follow
+    double inflation; // GDSF
+    ghost_t ghost;    // S3-FIFO
+    sketch_t sketch;  // TinyLFU
+} snap_shard_t;
+
+typedef struct {
+    uint64_t size;   // Data bytes
+    uint32_t keylen; // Key bytes, NUL included
+    uint32_t freq;
+    uint32_t in_small;
+    uint32_t unused; // Zero, keeps priority aligned
+    double priority;
+    int64_t expires; // When the node goes stale
+} snap_entry_t;
+
+// Nodes of a shard oldest first, in an order restore() rebuilds: the
+// S3-FIFO small queue, the main list, then the GDSF heap. Each is pinned
+// and its metadata copied under the lock, so the caller can write them out
+// while the shard keeps serving. Returns the number of nodes, or -1.
+static long long pin_shard(cache_shard_t *shard, cache_node_t ***nodes,
+                           snap_entry_t **entries, snap_shard_t *state) {
+    pthread_mutex_lock(&shard->lock);
+    size_t count = shard->count;
+    *nodes = malloc((count + 1) * sizeof(cache_node_t *));
+    *entries = malloc((count + 1) * sizeof(snap_entry_t));
+    if (*nodes == NULL || *entries == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(*nodes);
+        free(*entries);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (cache_node_t *node = shard->small_tail; node != NULL;
+         node = node->prev) {
+        (*nodes)[n++] = node;
+    }
+    for (cache_node_t *node = shard->tail; node != NULL; node = node->prev) {
+        (*nodes)[n++] = node;
+    }
+    for (size_t i = 0; i < shard->heap_len; i++) {
+        (*nodes)[n++] = shard->heap[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        cache_node_t *node = (*nodes)[i];
+        atomic_fetch_add(&node->refcnt, 1);
+        (*entries)[i] = (snap_entry_t){node->size, strlen(node->key) + 1,
+                                       node->freq, node->in_small, 0,
+                                       node->priority,
+                                       atomic_load(&node->expires)};
+    }
+    state->count = n;
+    state->inflation = shard->inflation;
+    state->ghost = shard->ghost;
+    state->sketch = shard->sketch;
+    pthread_mutex_unlock(&shard->lock);
+    return n;
+}
+
+// Write data segment by segment
+static bool write_segments(FILE *fp, const segbuf_t *data) {
+    for (size_t off = 0; off < data->len; off += SEGMENT_SIZE) {
+        size_t n = data->len - off < SEGMENT_SIZE ? data->len - off
+                                                  : SEGMENT_SIZE;
+        if (fwrite(data->segs[off >> SEGMENT_SHIFT], 1, n, fp) != n)
+            return false;
+    }
+    return true;
+}
+
+// Write every cached object with its policy metadata to path. The file is
+// written beside it and renamed into place, so a crash midway leaves the
+// previous snapshot intact. Returns the number of objects saved, or -1.
+long long cache_snapshot_save(const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    FILE *fp = fopen(tmp, "w");
+    snap_shard_t *state = malloc(sizeof(snap_shard_t));
+    if (fp == NULL || state == NULL) {
+        if (fp != NULL)
+            fclose(fp);
+        free(state);
+        return -1;
+    }
+
+    snap_header_t header = {.shards = CACHE_SHARDS};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    strncpy(header.policy, policy->name, sizeof(header.policy) - 1);
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    long long saved = 0;
+    for (int i = 0; ok && i < CACHE_SHARDS; i++) {
+        cache_node_t **nodes;
+        snap_entry_t *entries;
+        long long n = pin_shard(&cache.shards[i], &nodes, &entries, state);
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        ok = fwrite(state, sizeof(*state), 1, fp) == 1;
+        for (long long j = 0; j < n; j++) {
+            cache_node_t *node = nodes[j];
+            ok = ok && fwrite(&entries[j], sizeof(entries[j]), 1, fp) == 1 &&
+                 fwrite(node->key, entries[j].keylen, 1, fp) == 1 &&
+                 write_segments(fp, &node->data);
+            put_cache_node(node);
+        }
+        saved += n;
+        free(nodes);
+        free(entries);
+    }
+    free(state);
+
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return saved;
+}
+
+// Track a node loaded from a snapshot with its saved expiry and metadata,
+// or with fresh metadata if the snapshot came from another policy. Nodes
+// that no longer fit the shard are dropped.
+static bool restore_node(cache_node_t *node, time_t expires,
+                         bool same_policy) {
+    cache_shard_t *shard = node->shard;
+    atomic_init(&node->refcnt, 1);
+    node->prev = NULL;
+    read_node_meta(node, expires);
+
+    pthread_mutex_lock(&shard->lock);
+    bool ok = lookup_node(shard, node->key, node->hash) == NULL &&
+              shard->current_size + node->size <= shard->max_size &&
+              (same_policy ? policy->restore(shard, node)
+                           : policy->insert(shard, node));
+    if (ok) {
+        size_t index = node->hash & (shard->nbuckets - 1);
+        node->hnext = shard->buckets[index];
+        shard->buckets[index] = node;
+        shard->count++;
+        grow_table(shard);
+        shard->current_size += node->size;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ok;
+}
+
+// Load a snapshot written by cache_snapshot_save() into the empty cache
+// after init_cache(). The file is mapped rather than read, and objects are
+// copied from the mapping straight into their nodes. Returns the number of
+// objects loaded, or -1 if the file is missing or not a usable snapshot.
+long long cache_snapshot_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t)) {
+        close(fd);
+        return -1;
+    }
+    size_t len = st.st_size;
+    const char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                           fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise((void *)map, len, MADV_SEQUENTIAL);
+
+    snap_header_t header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.shards != CACHE_SHARDS) {
+        munmap((void *)map, len);
+        return -1;
+    }
+    header.policy[sizeof(header.policy) - 1] = '\0';
+    bool same_policy = strcmp(header.policy, policy->name) == 0;
+
+    // Entries are read with memcpy: nothing in the file is aligned
+    size_t off = sizeof(header);
+    long long loaded = 0;
+    snap_shard_t *state = malloc(sizeof(snap_shard_t));
+    for (int i = 0; state != NULL && i < CACHE_SHARDS; i++) {
+        if (len - off < sizeof(*state))
+            break;
+        memcpy(state, map + off, sizeof(*state));
+        off += sizeof(*state);
+
+        cache_shard_t *shard = &cache.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->sketch = state->sketch;
+        if (same_policy) {
+            shard->inflation = state->inflation;
+            shard->ghost = state->ghost;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        for (uint64_t j = 0; j < state->count; j++) {
+            snap_entry_t entry;
+            if (len - off < sizeof(entry))
+                break;
+            memcpy(&entry, map + off, sizeof(entry));
+            off += sizeof(entry);
+            if (entry.keylen == 0 || entry.size > max_object_size ||
+                len - off < (size_t)entry.keylen + entry.size ||
+                map[off + entry.keylen - 1] != '\0') {
+                off = len;
+                break;
+            }
+            const char *key = map + off;
+            const char *data = key + entry.keylen;
+            off += entry.keylen + entry.size;
+
+            cache_node_t *node = alloc_node(key, entry.size);
+            if (node == NULL)
+                continue;
+            segbuf_write(&node->data, 0, data, entry.size);
+            node->freq = entry.freq;
+            node->in_small = entry.in_small;
+            node->priority = entry.priority;
+            if (restore_node(node, entry.expires, same_policy))
+                loaded++;
+            else
+                free_cache_node(node);
+        }
+    }
+    free(state);
+    munmap((void *)map, len);
+    return loaded;
 }
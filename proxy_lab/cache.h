@@ -1,25 +1,139 @@
+#ifndef CACHE_H
+#define CACHE_H
+
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "cache_policy.h"
+#include "proxy.h"
+#include "segment.h"
+
+// Number of independently locked cache shards. Each shard gets an equal slice
+// of max_cache_size, so the slice must still be able to hold one object.
+#define CACHE_SHARDS 8
+
+// Initial bucket count of each shard's hash table (power of two). A table
+// doubles once it holds more than 3/4 as many nodes as buckets.
+#define CACHE_INIT_BUCKETS 64
+
+// Buckets in each shard's table of in-flight fetches (power of two)
+#define FLIGHT_BUCKETS 64
+
+// Most bytes of evicted nodes waiting to be spilled to the disk tier. Nodes
+// evicted while the queue is full are dropped instead.
+#define SPILL_QUEUE_BYTES (32 * 1024 * 1024)
+
+struct cache_shard;
 
 typedef struct cache_node {
-    char *key;               // Key (e.g., URL)
-    void *data;              // Cached data (e.g., HTML content)
-    int size;                // Size of the data
+    char *key;               // Key (e.g., URL), stored after the node
+    uint64_t hash;           // hash(key), computed once at insert
+    segbuf_t data;           // Cached data (e.g., HTML content) in segments
+    size_t size;             // Size of the data
+    atomic_int refcnt;       // One reference for the cache, one per reader
+    _Atomic time_t expires;  // Stale from this time on, see cache_node_fresh()
+    const char *etag;        // ETag value inside the stored head, or NULL
+    size_t etag_len;
+    const char *last_modified; // Last-Modified value inside the head, or NULL
+    size_t last_modified_len;
+    bool evicted;            // Dropped by the policy, spilled to disk when freed
+    uint64_t disk_gen;       // disk_cache_generation() when evicted
+    void *map;               // Disk-tier mapping holding the data of a node
+    size_t maplen;           // served from disk without being cached, or NULL
+    uint32_t freq;           // CLOCK reference bit, S3-FIFO or GDSF count
+    bool in_small;           // S3-FIFO: node is in the small queue
+    double priority;         // GDSF: inflation + freq * cost / size
+    size_t heap_index;       // GDSF: position in the shard's heap
+    struct cache_shard *shard; // Shard that accounts for this node's bytes
     struct cache_node *prev; // Pointer to previous node in linked list
     struct cache_node *next; // Pointer to next node in linked list
+    struct cache_node *hnext; // Next node in the same hash bucket
 } cache_node_t;
 
-typedef struct {
+// A miss being fetched from the origin. Once the fetcher knows the object
+// fits, it becomes a "filling" entry: the head and then the body are appended
+// to fill->data as they arrive, and later misses on the same key stream from it
+// instead of fetching the object again.
+typedef struct flight {
+    char *key;               // Key being fetched
+    uint64_t hash;           // hash(key)
+    int refs;                // Fetcher plus joiners, under the shard lock
+    bool done;               // Set once the fetcher has finished
+    bool failed;             // Finished without a complete object
+    cache_node_t *fill;      // Node being filled, NULL until the head is in
+    size_t head_len;         // Bytes of fill->data holding the response head
+    size_t size;             // Final size of the object
+    size_t filled;           // Bytes of fill->data written so far
+    cache_node_t *node;      // Cached result, pinned once per joiner, or NULL
+    pthread_cond_t cond;     // Signalled when fill, filled or done change
+    struct flight *next;     // Next flight in the same bucket
+} flight_t;
+
+// Outcome of cache_lookup()
+typedef enum { CACHE_HIT, CACHE_FETCH, CACHE_JOIN, CACHE_MISS } cache_lookup_t;
+
+typedef struct cache_shard {
     cache_node_t *head; // Pointer to the head of the doubly linked list (most
-                        // recently used)
+                        // recently used, or newest for CLOCK and S3-FIFO)
     cache_node_t *tail; // Pointer to the tail of the doubly linked list (least
-                        // recently used)
-    int current_size;   // Current total size of all cached objects
-    pthread_mutex_t lock; // Mutex lock for thread-safe operations
+                        // recently used, or oldest)
+    cache_node_t *hand; // CLOCK: next node to examine
+    cache_node_t *small_head; // S3-FIFO: small queue, newest first
+    cache_node_t *small_tail;
+    size_t small_size;  // S3-FIFO: bytes in the small queue
+    ghost_t ghost;      // S3-FIFO: keys recently evicted from the small queue
+    sketch_t sketch;    // TinyLFU: access frequencies of keys in this shard
+    cache_node_t **heap; // GDSF: min-heap of nodes by priority
+    size_t heap_len;
+    size_t heap_cap;
+    double inflation;   // GDSF: priority of the last evicted node
+    size_t current_size; // Current total size of objects in this shard
+    size_t pinned_size; // Bytes of evicted nodes still pinned by readers
+    size_t max_size;    // Byte budget of this shard
+    cache_node_t **buckets; // Chained hash table indexing this shard
+    size_t nbuckets;        // Number of buckets, always a power of two
+    size_t count;           // Number of nodes in the hash table
+    flight_t *flights[FLIGHT_BUCKETS]; // Fetches in progress on this shard
+    pthread_mutex_t lock; // Mutex lock protecting only this shard
+} cache_shard_t;
+
+typedef struct {
+    cache_shard_t shards[CACHE_SHARDS]; // Shards, selected by key hash
 } cache_t;
 
-unsigned int hash(const char *str);
-void remove_cache_node(cache_node_t *node);
-void add_cache_node(const char *key, const void *data, int size);
-int get_cache_node(const char *key, void **data, int *size);
+// Requests answered by the cache and bytes served, for hit ratios by object
+// and by byte
+typedef struct {
+    long long requests;  // Cacheable requests (GETs)
+    long long hits;      // Requests served from the cache
+    long long bytes;     // Response bytes of all counted requests
+    long long hit_bytes; // Response bytes served from the cache
+} cache_stats_t;
+
+uint64_t hash(const char *str);
+bool add_cache_node(const char *key, segbuf_t *data);
+cache_node_t *get_cache_node(const char *key);
+void put_cache_node(cache_node_t *node);
+bool cache_node_fresh(const cache_node_t *node);
+void cache_node_refresh(cache_node_t *node, time_t expires);
+cache_lookup_t cache_lookup(const char *key, cache_node_t **node,
+                            flight_t **flight);
+bool flight_begin_fill(flight_t *flight, segbuf_t *head, size_t size);
+void flight_append(flight_t *flight, const void *buf, size_t n);
+bool flight_finish(flight_t *flight, bool complete);
+ssize_t flight_wait(flight_t *flight, size_t offset);
+void flight_leave(flight_t *flight);
+void cache_count(bool hit, long long bytes);
+void cache_get_stats(cache_stats_t *stats);
+int cache_set_policy(const char *name, bool admission);
 void init_cache();
 void free_cache();
+long long cache_snapshot_save(const char *path);
+long long cache_snapshot_load(const char *path);
+
+#endif
@@ -0,0 +1,409 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "cache_policy.h"
+
+// Push a node at the head of a list
+static void list_push(cache_node_t **head, cache_node_t **tail,
+                      cache_node_t *node) {
+    node->prev = NULL;
+    node->next = *head;
+    if (*head)
+        (*head)->prev = node;
+    *head = node;
+    if (!*tail)
+        *tail = node;
+}
+
+// Unlink a node from a list
+static void list_unlink(cache_node_t **head, cache_node_t **tail,
+                        cache_node_t *node) {
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        *head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        *tail = node->prev;
+}
+
+/*
+ * LRU: every hit moves the node to the head, the tail is evicted.
+ */
+
+static bool lru_insert(cache_shard_t *shard, cache_node_t *node) {
+    list_push(&shard->head, &shard->tail, node);
+    return true;
+}
+
+static bool lru_restore(cache_shard_t *shard, cache_node_t *node) {
+    return lru_insert(shard, node);
+}
+
+static void lru_hit(cache_shard_t *shard, cache_node_t *node) {
+    if (node != shard->head) {
+        list_unlink(&shard->head, &shard->tail, node);
+        list_push(&shard->head, &shard->tail, node);
+    }
+}
+
+static void lru_remove(cache_shard_t *shard, cache_node_t *node) {
+    list_unlink(&shard->head, &shard->tail, node);
+}
+
+static cache_node_t *lru_victim(cache_shard_t *shard) {
+    return shard->tail;
+}
+
+static cache_node_t *lru_peek(const cache_shard_t *shard) {
+    return shard->tail;
+}
+
+/*
+ * CLOCK: nodes stay in insertion order and a hit only sets the reference
+ * bit. The hand sweeps from the oldest node towards the newest, clearing set
+ * bits, and evicts the first node whose bit is clear.
+ */
+
+static bool clock_insert(cache_shard_t *shard, cache_node_t *node) {
+    node->freq = 0;
+    list_push(&shard->head, &shard->tail, node);
+    return true;
+}
+
+// The reference bit is kept, the hand restarts from the oldest node
+static bool clock_restore(cache_shard_t *shard, cache_node_t *node) {
+    list_push(&shard->head, &shard->tail, node);
+    return true;
+}
+
+static void clock_hit(cache_shard_t *shard, cache_node_t *node) {
+    node->freq = 1;
+}
+
+static void clock_remove(cache_shard_t *shard, cache_node_t *node) {
+    if (shard->hand == node)
+        shard->hand = node->prev;
+    list_unlink(&shard->head, &shard->tail, node);
+}
+
+static cache_node_t *clock_victim(cache_shard_t *shard) {
+    // Two sweeps at most: the first clears every bit it passes
+    while (shard->tail != NULL) {
+        if (shard->hand == NULL)
+            shard->hand = shard->tail;
+        cache_node_t *node = shard->hand;
+        if (!node->freq)
+            return node;
+        node->freq = 0;
+        shard->hand = node->prev;
+    }
+    return NULL;
+}
+
+// Follow the hand without clearing bits: if every bit is set, the sweep
+// comes back to where it started
+static cache_node_t *clock_peek(const cache_shard_t *shard) {
+    if (shard->tail == NULL)
+        return NULL;
+    cache_node_t *start = shard->hand != NULL ? shard->hand : shard->tail;
+    cache_node_t *node = start;
+    do {
+        if (!node->freq)
+            return node;
+        node = node->prev != NULL ? node->prev : shard->tail;
+    } while (node != start);
+    return start;
+}
+
+/*
+ * S3-FIFO: new nodes enter a small FIFO holding about a tenth of the shard.
+ * Nodes hit while there move to the main FIFO; the others are evicted and
+ * their keys remembered in a ghost queue, so a key that comes back soon goes
+ * straight to main. Main is a FIFO with reinsertion: a node with hits left
+ * is moved back to the head with its count decremented.
+ */
+
+#define S3_FREQ_MAX 3
+
+// Hashes are remembered approximately: bucket counters may alias
+static bool ghost_contains(const ghost_t *ghost, uint64_t h) {
+    return ghost->counts[h & (GHOST_BUCKETS - 1)] > 0;
+}
+
+static void ghost_add(ghost_t *ghost, uint64_t h) {
+    if (ghost->count == GHOST_ENTRIES) {
+        uint64_t old = ghost->ring[ghost->next];
+        ghost->counts[old & (GHOST_BUCKETS - 1)]--;
+    } else {
+        ghost->count++;
+    }
+    ghost->ring[ghost->next] = h;
+    ghost->next = (ghost->next + 1) % GHOST_ENTRIES;
+    if (ghost->counts[h & (GHOST_BUCKETS - 1)] < UINT8_MAX)
+        ghost->counts[h & (GHOST_BUCKETS - 1)]++;
+}
+
+static bool s3fifo_insert(cache_shard_t *shard, cache_node_t *node) {
+    node->freq = 0;
+    if (ghost_contains(&shard->ghost, node->hash)) {
+        node->in_small = false;
+        list_push(&shard->head, &shard->tail, node);
+    } else {
+        node->in_small = true;
+        list_push(&shard->small_head, &shard->small_tail, node);
+        shard->small_size += node->size;
+    }
+    return true;
+}
+
+static bool s3fifo_restore(cache_shard_t *shard, cache_node_t *node) {
+    if (node->in_small) {
+        list_push(&shard->small_head, &shard->small_tail, node);
+        shard->small_size += node->size;
+    } else {
+        list_push(&shard->head, &shard->tail, node);
+    }
+    return true;
+}
+
+static void s3fifo_hit(cache_shard_t *shard, cache_node_t *node) {
+    if (node->freq < S3_FREQ_MAX)
+        node->freq++;
+}
+
+static void s3fifo_remove(cache_shard_t *shard, cache_node_t *node) {
+    if (node->in_small) {
+        list_unlink(&shard->small_head, &shard->small_tail, node);
+        shard->small_size -= node->size;
+        if (node->evicted)
+            ghost_add(&shard->ghost, node->hash);
+    } else {
+        list_unlink(&shard->head, &shard->tail, node);
+    }
+}
+
+static cache_node_t *s3fifo_victim(cache_shard_t *shard) {
+    while (1) {
+        cache_node_t *node;
+        if (shard->small_tail != NULL &&
+            (shard->small_size >= shard->max_size / 10 ||
+             shard->tail == NULL)) {
+            node = shard->small_tail;
+            if (node->freq == 0)
+                return node;
+            // Hit while in the small queue: promote to main
+            list_unlink(&shard->small_head, &shard->small_tail, node);
+            shard->small_size -= node->size;
+            node->in_small = false;
+            node->freq = 0;
+            list_push(&shard->head, &shard->tail, node);
+        } else if (shard->tail != NULL) {
+            node = shard->tail;
+            if (node->freq == 0)
+                return node;
+            node->freq--;
+            list_unlink(&shard->head, &shard->tail, node);
+            list_push(&shard->head, &shard->tail, node);
+        } else {
+            return NULL;
+        }
+    }
+}
+
+// Replay s3fifo_victim() without moving nodes. Nodes it would promote from
+// the small queue join main behind every node already there, with no hits.
+// Without such a node, main is swept until the node with the fewest hits
+// left runs out.
+static cache_node_t *s3fifo_peek(const cache_shard_t *shard) {
+    size_t small_size = shard->small_size;
+    bool main_empty = shard->tail == NULL;
+    cache_node_t *promoted = NULL; // First node promoted to main
+    cache_node_t *node = shard->small_tail;
+    while (node != NULL &&
+           (small_size >= shard->max_size / 10 || main_empty)) {
+        if (node->freq == 0)
+            return node;
+        small_size -= node->size;
+        if (promoted == NULL)
+            promoted = node;
+        main_empty = false;
+        node = node->prev;
+    }
+
+    cache_node_t *fewest = NULL;
+    for (node = shard->tail; node != NULL; node = node->prev) {
+        if (node->freq == 0)
+            return node;
+        if (fewest == NULL || node->freq < fewest->freq)
+            fewest = node;
+    }
+    return promoted != NULL ? promoted : fewest;
+}
+
+/*
+ * GDSF (GreedyDual-Size-Frequency): a node's priority is the shard's
+ * inflation value plus freq * cost / size, so small popular objects are kept
+ * over large cold ones. The node with the lowest priority is evicted and its
+ * priority becomes the new inflation value, which ages nodes that stop being
+ * hit. Nodes sit in a binary min-heap.
+ */
+
+#define GDSF_COST 1.0 // Every miss costs the same, which favours hit ratio
+
+static void heap_set(cache_shard_t *shard, size_t i, cache_node_t *node) {
+    shard->heap[i] = node;
+    node->heap_index = i;
+}
+
+static void heap_sift_up(cache_shard_t *shard, size_t i) {
+    cache_node_t *node = shard->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (shard->heap[parent]->priority <= node->priority)
+            break;
+        heap_set(shard, i, shard->heap[parent]);
+        i = parent;
+    }
+    heap_set(shard, i, node);
+}
+
+static void heap_sift_down(cache_shard_t *shard, size_t i) {
+    cache_node_t *node = shard->heap[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= shard->heap_len)
+            break;
+        if (child + 1 < shard->heap_len &&
+            shard->heap[child + 1]->priority < shard->heap[child]->priority)
+            child++;
+        if (node->priority <= shard->heap[child]->priority)
+            break;
+        heap_set(shard, i, shard->heap[child]);
+        i = child;
+    }
+    heap_set(shard, i, node);
+}
+
+static double gdsf_priority(cache_shard_t *shard, cache_node_t *node) {
+    double size = node->size > 0 ? node->size : 1;
+    return shard->inflation + node->freq * GDSF_COST / size;
+}
+
+// Add a node whose priority is set to the heap
+static bool heap_push(cache_shard_t *shard, cache_node_t *node) {
+    if (shard->heap_len == shard->heap_cap) {
+        size_t cap =
+            shard->heap_cap ? shard->heap_cap * 2 : CACHE_INIT_BUCKETS;
+        cache_node_t **heap = realloc(shard->heap, cap * sizeof(*heap));
+        if (heap == NULL)
+            return false;
+        shard->heap = heap;
+        shard->heap_cap = cap;
+    }
+    heap_set(shard, shard->heap_len++, node);
+    heap_sift_up(shard, node->heap_index);
+    return true;
+}
+
+static bool gdsf_insert(cache_shard_t *shard, cache_node_t *node) {
+    node->freq = 1;
+    node->priority = gdsf_priority(shard, node);
+    return heap_push(shard, node);
+}
+
+// Saved priorities stay comparable because the inflation value is restored
+// with them
+static bool gdsf_restore(cache_shard_t *shard, cache_node_t *node) {
+    return heap_push(shard, node);
+}
+
+static void gdsf_hit(cache_shard_t *shard, cache_node_t *node) {
+    node->freq++;
+    node->priority = gdsf_priority(shard, node);
+    heap_sift_down(shard, node->heap_index);
+}
+
+static void gdsf_remove(cache_shard_t *shard, cache_node_t *node) {
+    if (node->evicted && node->priority > shard->inflation)
+        shard->inflation = node->priority;
+
+    size_t i = node->heap_index;
+    cache_node_t *last = shard->heap[--shard->heap_len];
+    if (last != node) {
+        heap_set(shard, i, last);
+        heap_sift_up(shard, i);
+        heap_sift_down(shard, last->heap_index);
+    }
+}
+
+static cache_node_t *gdsf_victim(cache_shard_t *shard) {
+    return shard->heap_len > 0 ? shard->heap[0] : NULL;
+}
+
+static cache_node_t *gdsf_peek(const cache_shard_t *shard) {
+    return shard->heap_len > 0 ? shard->heap[0] : NULL;
+}
+
+static const cache_policy_t policies[] = {
+    {"lru", lru_insert, lru_restore, lru_hit, lru_remove, lru_victim,
+     lru_peek},
+    {"clock", clock_insert, clock_restore, clock_hit, clock_remove,
+     clock_victim, clock_peek},
+    {"s3fifo", s3fifo_insert, s3fifo_restore, s3fifo_hit, s3fifo_remove,
+     s3fifo_victim, s3fifo_peek},
+    {"gdsf", gdsf_insert, gdsf_restore, gdsf_hit, gdsf_remove, gdsf_victim,
+     gdsf_peek},
+};
+
+// Look up a policy by name, NULL if there is none
+const cache_policy_t *cache_policy_find(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, name) == 0)
+            return &policies[i];
+    }
+    return NULL;
+}
+
+/*
+ * TinyLFU count-min sketch: each row counts the key in one counter picked by
+ * its own multiplicative hash, and the estimate is the smallest of them.
+ * Counters are halved every SKETCH_RESET additions so old popularity fades.
+ */
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL,
+    0xd6e8feb86659fd93ULL};
+
+static inline size_t sketch_index(uint64_t h, int row) {
+    return (h * sketch_seeds[row]) >> (64 - __builtin_ctz(SKETCH_WIDTH));
+}
+
+void sketch_add(sketch_t *sketch, uint64_t h) {
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        uint8_t *c = &sketch->counts[i][sketch_index(h, i)];
+        if (*c < UINT8_MAX)
+            (*c)++;
+    }
+    if (++sketch->additions == SKETCH_RESET) {
+        for (int i = 0; i < SKETCH_DEPTH; i++) {
+            for (int j = 0; j < SKETCH_WIDTH; j++) {
+                sketch->counts[i][j] >>= 1;
+            }
+        }
+        sketch->additions = 0;
+    }
+}
+
+int sketch_estimate(const sketch_t *sketch, uint64_t h) {
+    int min = UINT8_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        int c = sketch->counts[i][sketch_index(h, i)];
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
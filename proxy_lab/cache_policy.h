@@ -0,0 +1,54 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cache_shard;
+struct cache_node;
+
+// S3-FIFO ghost queue: hashes of keys recently evicted from the small queue
+#define GHOST_ENTRIES 1024  // Hashes remembered per shard
+#define GHOST_BUCKETS 4096  // Membership counters (power of two)
+
+// TinyLFU count-min sketch, per shard
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096   // Counters per row (power of two)
+#define SKETCH_RESET (SKETCH_WIDTH * 8) // Additions before counters halve
+
+typedef struct {
+    uint64_t ring[GHOST_ENTRIES];  // Remembered hashes, oldest at next
+    int next;                      // Slot overwritten by the next addition
+    int count;                     // Slots in use
+    uint8_t counts[GHOST_BUCKETS]; // Remembered hashes per bucket
+} ghost_t;
+
+typedef struct {
+    uint8_t counts[SKETCH_DEPTH][SKETCH_WIDTH]; // Saturating counters
+    int additions;                              // Since the last halving
+} sketch_t;
+
+// An eviction policy orders the nodes of a shard. Every hook runs with the
+// shard lock held. insert() returns false if the node cannot be tracked, and
+// the insert is dropped. victim() picks the next node to evict without
+// unlinking it; the cache then removes it through remove(). Picking may
+// update policy state, e.g. clear reference bits; peek() returns the node
+// victim() would pick without changing anything. restore() tracks
+// a node loaded from a snapshot with the freq, in_small and priority it was
+// saved with; nodes are restored oldest first.
+typedef struct cache_policy {
+    const char *name;
+    bool (*insert)(struct cache_shard *shard, struct cache_node *node);
+    bool (*restore)(struct cache_shard *shard, struct cache_node *node);
+    void (*hit)(struct cache_shard *shard, struct cache_node *node);
+    void (*remove)(struct cache_shard *shard, struct cache_node *node);
+    struct cache_node *(*victim)(struct cache_shard *shard);
+    struct cache_node *(*peek)(const struct cache_shard *shard);
+} cache_policy_t;
+
+const cache_policy_t *cache_policy_find(const char *name);
+
+void sketch_add(sketch_t *sketch, uint64_t h);
+int sketch_estimate(const sketch_t *sketch, uint64_t h);
+
+#endif
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "conn_pool.h"
+
+#define POOL_BUCKETS 256
+#define POOL_KEY_LEN 512
+
+struct pool_origin;
+
+typedef struct pool_entry {
+    int fd;                     // Idle upstream socket
+    time_t idle_since;          // When the socket was returned
+    struct pool_origin *origin; // Origin the socket is connected to
+    struct pool_entry *lru_prev; // Next more recently used idle socket
+    struct pool_entry *lru_next; // Next less recently used idle socket
+    struct pool_entry *o_prev;   // Neighbours among the origin's sockets
+    struct pool_entry *o_next;
+} pool_entry_t;
+
+typedef struct pool_origin {
+    char *key;                 // "host:port"
+    uint64_t hash;             // hash(key)
+    int idle;                  // Number of idle sockets for this origin
+    pool_entry_t *conns;       // Idle sockets, most recently used first
+    struct pool_origin *next;  // Next origin in the same bucket
+} pool_origin_t;
+
+typedef struct {
+    pool_origin_t *buckets[POOL_BUCKETS]; // Origins with idle sockets
+    pool_entry_t *lru_head; // Most recently returned idle socket
+    pool_entry_t *lru_tail; // Least recently returned idle socket
+    int idle;               // Idle sockets across all origins
+    int max_per_host;       // Idle sockets kept per origin, 0 disables
+    pthread_mutex_t lock;   // Protects the whole pool
+} conn_pool_t;
+
+static conn_pool_t pool;
+
+// Build the "host:port" key of an origin
+static void origin_key(char *buf, size_t len, const char *host,
+                       const char *port) {
+    snprintf(buf, len, "%s:%s", host, port);
+}
+
+// Find an origin, optionally creating it. Caller holds pool.lock.
+static pool_origin_t *find_origin(const char *key, bool create) {
+    uint64_t h = hash(key);
+    pool_origin_t **link = &pool.buckets[h % POOL_BUCKETS];
+    for (pool_origin_t *o = *link; o != NULL; o = o->next) {
+        if (o->hash == h && strcmp(o->key, key) == 0)
+            return o;
+    }
+    if (!create)
+        return NULL;
+
+    pool_origin_t *o = calloc(1, sizeof(pool_origin_t));
+    if (o == NULL || (o->key = strdup(key)) == NULL) {
+        free(o);
+        return NULL;
+    }
+    o->hash = h;
+    o->next = *link;
+    *link = o;
+    return o;
+}
+
+// Drop an origin that has no idle sockets left. Caller holds pool.lock.
+static void release_origin(pool_origin_t *o) {
+    if (o->idle > 0)
+        return;
+
+    pool_origin_t **link = &pool.buckets[o->hash % POOL_BUCKETS];
+    while (*link != o) {
+        link = &(*link)->next;
+    }
+    *link = o->next;
+    free(o->key);
+    free(o);
+}
+
+// Unlink an idle entry from both lists and return its socket. Caller holds
+// pool.lock; the origin may be freed.
+static int take_entry(pool_entry_t *e) {
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        pool.lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        pool.lru_tail = e->lru_prev;
+
+    pool_origin_t *o = e->origin;
+    if (e->o_prev)
+        e->o_prev->o_next = e->o_next;
+    else
+        o->conns = e->o_next;
+    if (e->o_next)
+        e->o_next->o_prev = e->o_prev;
+
+    o->idle--;
+    pool.idle--;
+    release_origin(o);
+
+    int fd = e->fd;
+    free(e);
+    return fd;
+}
+
+// Close idle sockets past POOL_IDLE_TIMEOUT, oldest first. The closed
+// descriptors are returned in fds so they can be closed outside the lock.
+// Caller holds pool.lock.
+static int expire_idle(time_t now, int *fds, int max) {
+    int n = 0;
+    while (n < max && pool.lru_tail != NULL &&
+           now - pool.lru_tail->idle_since >= POOL_IDLE_TIMEOUT) {
+        fds[n++] = take_entry(pool.lru_tail);
+    }
+    return n;
+}
+
+// A pooled socket is healthy if the server has neither closed it nor sent
+// unsolicited bytes while it sat idle
+static bool socket_healthy(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void conn_pool_init(int max_per_host) {
+    memset(pool.buckets, 0, sizeof(pool.buckets));
+    pool.lru_head = NULL;
+    pool.lru_tail = NULL;
+    pool.idle = 0;
+    pool.max_per_host = max_per_host;
+    pthread_mutex_init(&pool.lock, NULL);
+}
+
+bool conn_pool_enabled(void) {
+    return pool.max_per_host > 0;
+}
+
+// Take a healthy idle socket to host:port, or return -1 if there is none.
+// Sockets that fail the health check are closed and skipped. The check is a
+// syscall, so it runs outside the pool lock.
+int conn_pool_get(const char *host, const char *port) {
+    char key[POOL_KEY_LEN];
+    int expired[POOL_MAX_IDLE];
+
+    if (!conn_pool_enabled())
+        return -1;
+    origin_key(key, sizeof(key), host, port);
+
+    while (1) {
+        int fd = -1;
+        pthread_mutex_lock(&pool.lock);
+        int nexpired = expire_idle(time(NULL), expired, POOL_MAX_IDLE);
+        pool_origin_t *o = find_origin(key, false);
+        if (o != NULL) {
+            fd = take_entry(o->conns);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        for (int i = 0; i < nexpired; i++) {
+            close(expired[i]);
+        }
+        if (fd < 0 || socket_healthy(fd))
+            return fd;
+        close(fd);
+    }
+}
+
+// Return a socket whose last response was fully read. If the origin already
+// has max_per_host idle sockets, or the pool is full, the least recently
+// used socket is closed to make room.
+void conn_pool_put(const char *host, const char *port, int fd) {
+    char key[POOL_KEY_LEN];
+    int victims[POOL_MAX_IDLE + 2];
+    int nvictims;
+
+    pool_entry_t *e = malloc(sizeof(pool_entry_t));
+    if (!conn_pool_enabled() || e == NULL) {
+        free(e);
+        close(fd);
+        return;
+    }
+    origin_key(key, sizeof(key), host, port);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    nvictims = expire_idle(now, victims, POOL_MAX_IDLE);
+
+    // Make room: this origin's oldest socket, else the pool's oldest
+    pool_origin_t *o = find_origin(key, false);
+    if (o != NULL && o->idle >= pool.max_per_host) {
+        pool_entry_t *oldest = o->conns;
+        while (oldest->o_next != NULL) {
+            oldest = oldest->o_next;
+        }
+        victims[nvictims++] = take_entry(oldest);
+    } else if (pool.idle >= POOL_MAX_IDLE) {
+        victims[nvictims++] = take_entry(pool.lru_tail);
+    }
+
+    o = find_origin(key, true);
+    if (o == NULL) {
+        free(e);
+        victims[nvictims++] = fd;
+    } else {
+        e->fd = fd;
+        e->idle_since = now;
+        e->origin = o;
+        e->o_prev = NULL;
+        e->o_next = o->conns;
+        if (o->conns)
+            o->conns->o_prev = e;
+        o->conns = e;
+        e->lru_prev = NULL;
+        e->lru_next = pool.lru_head;
+        if (pool.lru_head)
+            pool.lru_head->lru_prev = e;
+        pool.lru_head = e;
+        if (!pool.lru_tail)
+            pool.lru_tail = e;
+        o->idle++;
+        pool.idle++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < nvictims; i++) {
+        close(victims[i]);
+    }
+}
+
+// Close every idle socket
+void conn_pool_free(void) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.lru_tail != NULL) {
+        close(take_entry(pool.lru_tail));
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,17 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <stdbool.h>
+
+// Idle persistent upstream connections, keyed by "host:port"
+#define DEFAULT_POOL_PER_HOST 4
+#define POOL_MAX_IDLE 256     // Idle sockets kept across all origins
+#define POOL_IDLE_TIMEOUT 30  // Seconds before an idle socket is closed
+
+void conn_pool_init(int max_per_host);
+bool conn_pool_enabled(void);
+int conn_pool_get(const char *host, const char *port);
+void conn_pool_put(const char *host, const char *port, int fd);
+void conn_pool_free(void);
+
+#endif
@@ -0,0 +1,332 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "disk_cache.h"
+
+#define DISK_MAGIC 0x70786332 // "pxc2"
+#define DISK_PREFIX "obj-"
+
+// Layout of an entry file: this header, the key, then the object
+typedef struct {
+    uint32_t magic;
+    uint32_t keylen;
+    uint32_t size;
+    uint32_t unused; // Zero, keeps expires aligned
+    int64_t expires; // When the object goes stale
+} disk_header_t;
+
+typedef struct disk_entry {
+    char *key;               // Cache key
+    uint64_t hash;           // hash(key)
+    uint64_t seq;            // Names the entry's file
+    long long bytes;         // File size, charged to the budget
+    struct disk_entry *prev; // Next more recently used entry
+    struct disk_entry *next; // Next less recently used entry
+    struct disk_entry *hnext; // Next entry in the same bucket
+} disk_entry_t;
+
+typedef struct {
+    char *dir;             // Directory holding the entry files, NULL if off
+    long long budget;      // Bytes of files kept at most
+    long long used;        // Bytes of files indexed
+    uint64_t next_seq;     // Sequence number of the next file
+    disk_entry_t *buckets[DISK_BUCKETS]; // Index by key hash
+    _Atomic uint64_t gens[DISK_BUCKETS]; // Removals per bucket, see
+                                         // disk_cache_generation()
+    disk_entry_t *head;    // Most recently used entry
+    disk_entry_t *tail;    // Least recently used entry
+    pthread_mutex_t lock;  // Protects the index, not the files
+} disk_cache_t;
+
+static disk_cache_t disk = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void entry_path(char *buf, size_t len, uint64_t seq) {
+    snprintf(buf, len, "%s/" DISK_PREFIX "%016" PRIx64, disk.dir, seq);
+}
+
+// Find an entry by key, caller holds disk.lock
+static disk_entry_t *find_entry(const char *key, uint64_t h) {
+    disk_entry_t *e = disk.buckets[h % DISK_BUCKETS];
+    while (e != NULL) {
+        if (e->hash == h && strcmp(e->key, key) == 0)
+            return e;
+        e = e->hnext;
+    }
+    return NULL;
+}
+
+// Unlink an entry from the LRU list, caller holds disk.lock
+static void unlink_lru(disk_entry_t *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        disk.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        disk.tail = e->prev;
+}
+
+// Unlink an entry from the LRU list and the index, caller holds disk.lock
+static void detach_entry(disk_entry_t *e) {
+    unlink_lru(e);
+    disk_entry_t **link = &disk.buckets[e->hash % DISK_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->hnext;
+    }
+    *link = e->hnext;
+    disk.used -= e->bytes;
+}
+
+// Put an entry at the head of the LRU list, caller holds disk.lock
+static void push_entry(disk_entry_t *e) {
+    e->prev = NULL;
+    e->next = disk.head;
+    if (disk.head)
+        disk.head->prev = e;
+    disk.head = e;
+    if (!disk.tail)
+        disk.tail = e;
+}
+
+// Delete the files of detached entries and free them, without the lock
+static void free_entries(disk_entry_t *victims) {
+    char path[PATH_MAX];
+    while (victims != NULL) {
+        disk_entry_t *next = victims->next;
+        entry_path(path, sizeof(path), victims->seq);
+        unlink(path);
+        free(victims->key);
+        free(victims);
+        victims = next;
+    }
+}
+
+// Enable the disk tier in dir, creating it if needed. Entry files left over
+// from an earlier run are not indexed, so they are deleted.
+int disk_cache_init(const char *dir, long long budget) {
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    char path[PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, DISK_PREFIX, strlen(DISK_PREFIX)) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+
+    if ((disk.dir = strdup(dir)) == NULL)
+        return -1;
+    disk.budget = budget;
+    return 0;
+}
+
+bool disk_cache_enabled(void) {
+    return disk.dir != NULL;
+}
+
+// Generation of key's bucket, h being hash(key). disk_cache_remove() bumps it,
+// so a copy taken at an earlier generation may be older than what replaced it.
+uint64_t disk_cache_generation(uint64_t h) {
+    return atomic_load(&disk.gens[h % DISK_BUCKETS]);
+}
+
+// Write an object evicted from memory to disk, replacing any older file for
+// the key. The file is written outside the lock; the least recently used
+// files are deleted to stay in budget. expires is kept with the object, so
+// a lifetime extended by revalidation survives the trip to disk. gen is
+// disk_cache_generation() from before the object left memory: if the key
+// was removed since, a newer copy superseded it and the file is dropped.
+void disk_cache_store(const char *key, const segbuf_t *data, time_t expires,
+                      uint64_t gen) {
+    if (!disk_cache_enabled() || data->len > UINT32_MAX)
+        return;
+    disk_header_t hdr = {DISK_MAGIC, strlen(key), data->len, 0, expires};
+    long long bytes = sizeof(hdr) + hdr.keylen + data->len;
+    if (bytes > disk.budget)
+        return;
+
+    uint64_t h = hash(key);
+    pthread_mutex_lock(&disk.lock);
+    uint64_t seq = disk.next_seq++;
+    pthread_mutex_unlock(&disk.lock);
+
+    disk_entry_t *e = malloc(sizeof(disk_entry_t));
+    if (e == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        return;
+    }
+    e->hash = h;
+    e->seq = seq;
+    e->bytes = bytes;
+
+    // Write the file under its final name; it is only found once indexed.
+    // The header and key go out with the first batch of segments.
+    char path[PATH_MAX];
+    entry_path(path, sizeof(path), seq);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    struct iovec iov[SEGMENT_IOVS + 2] = {{&hdr, sizeof(hdr)},
+                                          {(void *)key, hdr.keylen}};
+    int iovcnt = 2;
+    size_t batch = sizeof(hdr) + hdr.keylen;
+    size_t off = 0;
+    long long written = 0;
+    while (fd >= 0) {
+        int cnt = SEGMENT_IOVS;
+        size_t n = segbuf_iov(data, off, data->len - off, iov + iovcnt, &cnt);
+        off += n;
+        batch += n;
+        if (writev(fd, iov, iovcnt + cnt) != (ssize_t)batch)
+            break;
+        written += batch;
+        if (off == data->len)
+            break;
+        iovcnt = 0;
+        batch = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (written != bytes) {
+        e->next = NULL;
+        free_entries(e);
+        return;
+    }
+
+    disk_entry_t *victims = NULL;
+    pthread_mutex_lock(&disk.lock);
+    if (atomic_load(&disk.gens[h % DISK_BUCKETS]) != gen) {
+        pthread_mutex_unlock(&disk.lock);
+        e->next = NULL;
+        free_entries(e);
+        return;
+    }
+    disk_entry_t *old = find_entry(key, h);
+    if (old != NULL) {
+        detach_entry(old);
+        old->next = victims;
+        victims = old;
+    }
+    e->hnext = disk.buckets[h % DISK_BUCKETS];
+    disk.buckets[h % DISK_BUCKETS] = e;
+    push_entry(e);
+    disk.used += bytes;
+    while (disk.used > disk.budget) {
+        old = disk.tail;
+        detach_entry(old);
+        old->next = victims;
+        victims = old;
+    }
+    pthread_mutex_unlock(&disk.lock);
+    free_entries(victims);
+}
+
+// Map an object's file read-only. The mapping stays valid until
+// disk_cache_close(), even if the file is evicted meanwhile. Returns false on
+// a miss; a file deleted by a concurrent eviction is a miss too.
+bool disk_cache_open(const char *key, disk_object_t *obj) {
+    if (!disk_cache_enabled())
+        return false;
+
+    uint64_t h = hash(key);
+    pthread_mutex_lock(&disk.lock);
+    disk_entry_t *e = find_entry(key, h);
+    if (e == NULL) {
+        pthread_mutex_unlock(&disk.lock);
+        return false;
+    }
+    unlink_lru(e);
+    push_entry(e);
+    uint64_t seq = e->seq;
+    pthread_mutex_unlock(&disk.lock);
+
+    char path[PATH_MAX];
+    entry_path(path, sizeof(path), seq);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(disk_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    // Check the file really holds this key before trusting it
+    disk_header_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    long long bytes = sizeof(hdr) + (long long)hdr.keylen + hdr.size;
+    if (hdr.magic != DISK_MAGIC || hdr.keylen != strlen(key) ||
+        st.st_size != bytes ||
+        memcmp(map + sizeof(hdr), key, hdr.keylen) != 0) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    obj->map = map;
+    obj->maplen = st.st_size;
+    obj->data = map + sizeof(hdr) + hdr.keylen;
+    obj->size = hdr.size;
+    obj->expires = hdr.expires;
+    return true;
+}
+
+void disk_cache_close(disk_object_t *obj) {
+    munmap(obj->map, obj->maplen);
+}
+
+// Forget a key, e.g. because a newer copy was cached. Stores of older copies
+// still in progress are dropped too.
+void disk_cache_remove(const char *key) {
+    if (!disk_cache_enabled())
+        return;
+
+    uint64_t h = hash(key);
+    pthread_mutex_lock(&disk.lock);
+    atomic_fetch_add(&disk.gens[h % DISK_BUCKETS], 1);
+    disk_entry_t *e = find_entry(key, h);
+    if (e != NULL) {
+        detach_entry(e);
+        e->next = NULL;
+    }
+    pthread_mutex_unlock(&disk.lock);
+    free_entries(e);
+}
+
+// Delete every entry file and disable the tier
+void disk_cache_free(void) {
+    if (!disk_cache_enabled())
+        return;
+
+    pthread_mutex_lock(&disk.lock);
+    disk_entry_t *victims = disk.head;
+    memset(disk.buckets, 0, sizeof(disk.buckets));
+    disk.head = NULL;
+    disk.tail = NULL;
+    disk.used = 0;
+    pthread_mutex_unlock(&disk.lock);
+    free_entries(victims);
+
+    free(disk.dir);
+    disk.dir = NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "segment.h"
+
+// Second cache tier: objects evicted from memory are kept as files in a
+// local directory, indexed in memory, and promoted back to memory on a hit
+#define DEFAULT_DISK_BUDGET_MB 1024
+#define DISK_BUCKETS 4096
+
+// An object mapped from its file by disk_cache_open()
+typedef struct {
+    void *map;        // Mapping of the whole file
+    size_t maplen;    // Length of the mapping
+    const void *data; // The object inside the mapping
+    size_t size;      // Size of the object
+    time_t expires;   // When the object goes stale, as stored
+} disk_object_t;
+
+int disk_cache_init(const char *dir, long long budget);
+bool disk_cache_enabled(void);
+uint64_t disk_cache_generation(uint64_t h);
+void disk_cache_store(const char *key, const segbuf_t *data, time_t expires,
+                      uint64_t gen);
+bool disk_cache_open(const char *key, disk_object_t *obj);
+void disk_cache_close(disk_object_t *obj);
+void disk_cache_remove(const char *key);
+void disk_cache_free(void);
+
+#endif
@@ -0,0 +1,569 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "dns_cache.h"
+
+typedef struct dns_entry {
+    char *host;              // Name as it appears in requests
+    uint64_t hash;           // hash(host)
+    int naddrs;              // 0 if unresolved or the lookup failed
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS]; // Port left at 0
+    socklen_t addrlens[DNS_MAX_ADDRS];
+    time_t expires;          // Monotonic second the answer goes stale
+    bool pinned;             // From the hosts file, never expires
+    bool resolving;          // A thread is running getaddrinfo() for it
+    bool queued;             // Waiting for the refresh thread
+    struct dns_entry *next;  // Next entry in the same bucket
+    struct dns_entry *qnext; // Next entry waiting for a refresh
+} dns_entry_t;
+
+// Reverse lookup of a client address, for logging only
+typedef struct rdns_entry {
+    char *addr;                 // Numeric address, the key
+    uint64_t hash;              // hash(addr)
+    struct sockaddr_storage sa; // Address to look up
+    socklen_t salen;            // Length of sa
+    char *name;                 // Host name, NULL if unknown
+    time_t expires;             // Monotonic second the answer goes stale
+    bool resolving;             // The refresh thread is looking it up
+    bool queued;                // Waiting for the refresh thread
+    struct rdns_entry *next;    // Next entry in the same bucket
+    struct rdns_entry *qnext;   // Next entry waiting for a lookup
+} rdns_entry_t;
+
+typedef struct {
+    dns_entry_t *buckets[DNS_BUCKETS]; // Index by host hash
+    int count;               // Entries in the index
+    int ttl;                 // Seconds a resolved name is trusted
+    dns_entry_t *queue;      // Entries waiting for the refresh thread
+    rdns_entry_t *rbuckets[DNS_BUCKETS]; // Reverse index by address hash
+    int rcount;              // Entries in the reverse index
+    rdns_entry_t *rqueue;    // Reverse lookups waiting for the thread
+    bool running;            // The refresh thread was started
+    bool stop;               // Asks the refresh thread to exit
+    pthread_t refresher;     // Re-resolves names before they expire
+    int *watchers;           // Event loop eventfds signalled by store()
+    int nwatchers;           // Entries in watchers
+    pthread_mutex_t lock;    // Protects everything above
+    pthread_cond_t resolved; // Broadcast when a lookup finishes
+    pthread_cond_t refresh;  // Signalled when the queue grows
+} dns_cache_t;
+
+static dns_cache_t dns = {.ttl = DEFAULT_DNS_TTL,
+                          .lock = PTHREAD_MUTEX_INITIALIZER,
+                          .resolved = PTHREAD_COND_INITIALIZER,
+                          .refresh = PTHREAD_COND_INITIALIZER};
+
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool fresh(const dns_entry_t *e, time_t t) {
+    return e->pinned || e->expires > t;
+}
+
+// Find an entry by name, caller holds dns.lock
+static dns_entry_t *find_entry(const char *host, uint64_t h) {
+    for (dns_entry_t *e = dns.buckets[h % DNS_BUCKETS]; e != NULL;
+         e = e->next) {
+        if (e->hash == h && strcmp(e->host, host) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+// Drop stale entries nobody is using, caller holds dns.lock
+static void expire_entries(time_t t) {
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        dns_entry_t **link = &dns.buckets[i];
+        while (*link != NULL) {
+            dns_entry_t *e = *link;
+            if (fresh(e, t) || e->resolving || e->queued) {
+                link = &e->next;
+                continue;
+            }
+            *link = e->next;
+            dns.count--;
+            free(e->host);
+            free(e);
+        }
+    }
+}
+
+// Add an unresolved entry, or return NULL if the index is full of live
+// names. Caller holds dns.lock.
+static dns_entry_t *new_entry(const char *host, uint64_t h) {
+    if (dns.count >= DNS_MAX_ENTRIES)
+        expire_entries(now());
+    if (dns.count >= DNS_MAX_ENTRIES)
+        return NULL;
+
+    dns_entry_t *e = calloc(1, sizeof(dns_entry_t));
+    if (e == NULL || (e->host = strdup(host)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->hash = h;
+    e->next = dns.buckets[h % DNS_BUCKETS];
+    dns.buckets[h % DNS_BUCKETS] = e;
+    dns.count++;
+    return e;
+}
+
+// Run the real lookup, without the lock. Returns the number of addresses.
+static int resolve(const char *host, struct sockaddr_storage *addrs,
+                   socklen_t *addrlens) {
+    struct addrinfo hints, *listp, *p;
+    int n = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if (getaddrinfo(host, NULL, &hints, &listp) != 0)
+        return 0;
+    for (p = listp; p != NULL && n < DNS_MAX_ADDRS; p = p->ai_next) {
+        memcpy(&addrs[n], p->ai_addr, p->ai_addrlen);
+        addrlens[n++] = p->ai_addrlen;
+    }
+    freeaddrinfo(listp);
+    return n;
+}
+
+// Record the result of a lookup and wake its waiters, event loops included.
+// A failed refresh keeps the old answer until it expires. Caller holds
+// dns.lock.
+static void store(dns_entry_t *e, const struct sockaddr_storage *addrs,
+                  const socklen_t *addrlens, int n, time_t t) {
+    if (n > 0) {
+        memcpy(e->addrs, addrs, n * sizeof(addrs[0]));
+        memcpy(e->addrlens, addrlens, n * sizeof(addrlens[0]));
+        e->naddrs = n;
+        e->expires = t + dns.ttl;
+    } else if (!fresh(e, t)) {
+        e->naddrs = 0;
+        e->expires = t + DNS_NEGATIVE_TTL;
+    }
+    e->resolving = false;
+    pthread_cond_broadcast(&dns.resolved);
+
+    uint64_t one = 1;
+    for (int i = 0; i < dns.nwatchers; i++) {
+        // Fails only when the counter is full, which wakes the loop anyway
+        if (write(dns.watchers[i], &one, sizeof(one)) < 0)
+            continue;
+    }
+}
+
+// Hand an entry to the refresh thread, caller holds dns.lock
+static void queue_entry(dns_entry_t *e) {
+    e->queued = true;
+    e->qnext = dns.queue;
+    dns.queue = e;
+    pthread_cond_signal(&dns.refresh);
+}
+
+// Hand a name that is about to expire to the refresh thread, so its users
+// never wait for the lookup. Caller holds dns.lock.
+static void maybe_refresh(dns_entry_t *e, time_t t) {
+    int ahead = dns.ttl < 2 * DNS_REFRESH_AHEAD ? dns.ttl / 2
+                                                : DNS_REFRESH_AHEAD;
+    if (!dns.running || e->pinned || e->naddrs == 0 || e->resolving ||
+        e->queued || e->expires - t > ahead)
+        return;
+    queue_entry(e);
+}
+
+// Look up the name of a client address for the refresh thread, which holds
+// dns.lock
+static void reverse_lookup(rdns_entry_t *e) {
+    char name[NI_MAXHOST];
+
+    // The entry cannot be freed while it is resolving
+    e->resolving = true;
+    pthread_mutex_unlock(&dns.lock);
+    int res = getnameinfo((struct sockaddr *)&e->sa, e->salen, name,
+                          sizeof(name), NULL, 0, NI_NAMEREQD);
+    pthread_mutex_lock(&dns.lock);
+    free(e->name);
+    e->name = res == 0 ? strdup(name) : NULL;
+    e->expires = now() + (e->name != NULL ? dns.ttl : DNS_NEGATIVE_TTL);
+    e->resolving = false;
+}
+
+static void *refresher(void *arg) {
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addrlens[DNS_MAX_ADDRS];
+
+    pthread_mutex_lock(&dns.lock);
+    while (1) {
+        while (dns.queue == NULL && dns.rqueue == NULL && !dns.stop) {
+            pthread_cond_wait(&dns.refresh, &dns.lock);
+        }
+        if (dns.stop)
+            break;
+
+        // Upstream names first: requests may be about to need them
+        if (dns.queue == NULL) {
+            rdns_entry_t *r = dns.rqueue;
+            dns.rqueue = r->qnext;
+            r->queued = false;
+            reverse_lookup(r);
+            continue;
+        }
+        dns_entry_t *e = dns.queue;
+        dns.queue = e->qnext;
+        e->queued = false;
+        if (e->resolving)
+            continue;
+
+        // The entry cannot be freed while it is resolving
+        e->resolving = true;
+        pthread_mutex_unlock(&dns.lock);
+        int n = resolve(e->host, addrs, addrlens);
+        pthread_mutex_lock(&dns.lock);
+        store(e, addrs, addrlens, n, now());
+    }
+    pthread_mutex_unlock(&dns.lock);
+    return NULL;
+}
+
+// Parse a numeric IPv4 or IPv6 address
+static bool parse_addr(const char *s, struct sockaddr_storage *ss,
+                       socklen_t *len) {
+    memset(ss, 0, sizeof(*ss));
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    if (inet_pton(AF_INET, s, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        *len = sizeof(*sin);
+        return true;
+    }
+    if (inet_pton(AF_INET6, s, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        *len = sizeof(*sin6);
+        return true;
+    }
+    return false;
+}
+
+// Pin the names of a hosts(5)-style file: "address name [alias...]" per
+// line, '#' starts a comment. A name listed on several lines gets all of
+// their addresses.
+static int load_hosts(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *save;
+        char *addr = strtok_r(line, " \t\r\n", &save);
+        if (addr == NULL)
+            continue;
+        struct sockaddr_storage ss;
+        socklen_t len;
+        if (!parse_addr(addr, &ss, &len)) {
+            fprintf(stderr, "Bad address in %s: %s\n", path, addr);
+            continue;
+        }
+
+        char *name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            uint64_t h = hash(name);
+            dns_entry_t *e = find_entry(name, h);
+            if (e == NULL && (e = new_entry(name, h)) == NULL)
+                continue;
+            e->pinned = true;
+            if (e->naddrs < DNS_MAX_ADDRS) {
+                e->addrs[e->naddrs] = ss;
+                e->addrlens[e->naddrs++] = len;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Set the positive TTL, pin the names of hosts_file (may be NULL) and start
+// the refresh thread
+int dns_cache_init(const char *hosts_file, int ttl) {
+    pthread_mutex_lock(&dns.lock);
+    dns.ttl = ttl;
+    int res = hosts_file != NULL ? load_hosts(hosts_file) : 0;
+    pthread_mutex_unlock(&dns.lock);
+    if (res < 0)
+        return -1;
+
+    if (pthread_create(&dns.refresher, NULL, refresher, NULL) == 0) {
+        dns.running = true;
+    }
+    return 0;
+}
+
+// Parse a numeric port, or return -1
+static long parse_port(const char *port) {
+    char *end;
+    long portnum = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || portnum < 0 || portnum > 65535)
+        return -1;
+    return portnum;
+}
+
+// Copy the answer of e into out, caller holds dns.lock
+static void copy_addrs(dns_addrs_t *out, const dns_entry_t *e) {
+    out->naddrs = e->naddrs;
+    memcpy(out->addrs, e->addrs, e->naddrs * sizeof(e->addrs[0]));
+    memcpy(out->addrlens, e->addrlens, e->naddrs * sizeof(e->addrlens[0]));
+}
+
+// Fill in the port of every address in out, and return 0, or -1 if there
+// are none
+static int set_port(dns_addrs_t *out, long portnum) {
+    for (int i = 0; i < out->naddrs; i++) {
+        struct sockaddr *sa = (struct sockaddr *)&out->addrs[i];
+        if (sa->sa_family == AF_INET)
+            ((struct sockaddr_in *)sa)->sin_port = htons(portnum);
+        else if (sa->sa_family == AF_INET6)
+            ((struct sockaddr_in6 *)sa)->sin6_port = htons(portnum);
+    }
+    return out->naddrs > 0 ? 0 : -1;
+}
+
+// Resolve host and fill out with its addresses on the numeric port. Cached
+// answers are returned without a syscall; concurrent misses on one name
+// share a single getaddrinfo() call. Failed lookups are remembered for
+// DNS_NEGATIVE_TTL seconds. Returns 0, or -1 if the name does not resolve.
+int dns_lookup(const char *host, const char *port, dns_addrs_t *out) {
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addrlens[DNS_MAX_ADDRS];
+
+    long portnum = parse_port(port);
+    if (portnum < 0)
+        return -1;
+
+    uint64_t h = hash(host);
+    pthread_mutex_lock(&dns.lock);
+    dns_entry_t *e;
+    while ((e = find_entry(host, h)) != NULL && e->resolving &&
+           !fresh(e, now())) {
+        pthread_cond_wait(&dns.resolved, &dns.lock);
+    }
+    if (e == NULL)
+        e = new_entry(host, h);
+
+    if (e == NULL) {
+        // Index full of live names: resolve without caching
+        pthread_mutex_unlock(&dns.lock);
+        out->naddrs = resolve(host, out->addrs, out->addrlens);
+    } else {
+        if (!fresh(e, now())) {
+            e->resolving = true;
+            pthread_mutex_unlock(&dns.lock);
+            int n = resolve(host, addrs, addrlens);
+            pthread_mutex_lock(&dns.lock);
+            store(e, addrs, addrlens, n, now());
+        } else {
+            maybe_refresh(e, now());
+        }
+        copy_addrs(out, e);
+        pthread_mutex_unlock(&dns.lock);
+    }
+    return set_port(out, portnum);
+}
+
+// dns_lookup() for event loops, which must not block: a name with no fresh
+// answer is handed to the refresh thread and DNS_PENDING returned. The loop
+// parks the request and retries when its dns_watch() fd is signalled.
+// Without a refresh thread this falls back to dns_lookup().
+int dns_lookup_async(const char *host, const char *port, dns_addrs_t *out) {
+    long portnum = parse_port(port);
+    if (portnum < 0)
+        return -1;
+    if (!dns.running)
+        return dns_lookup(host, port, out);
+
+    uint64_t h = hash(host);
+    time_t t = now();
+    pthread_mutex_lock(&dns.lock);
+    dns_entry_t *e = find_entry(host, h);
+    if (e == NULL && (e = new_entry(host, h)) == NULL) {
+        // Index full of live names, and resolving here would block
+        pthread_mutex_unlock(&dns.lock);
+        return -1;
+    }
+    if (!fresh(e, t)) {
+        if (!e->resolving && !e->queued)
+            queue_entry(e);
+        pthread_mutex_unlock(&dns.lock);
+        return DNS_PENDING;
+    }
+    maybe_refresh(e, t);
+    copy_addrs(out, e);
+    pthread_mutex_unlock(&dns.lock);
+    return set_port(out, portnum);
+}
+
+// Register an eventfd to be signalled whenever a lookup finishes. Returns 0,
+// or -1 if out of memory.
+int dns_watch(int fd) {
+    pthread_mutex_lock(&dns.lock);
+    int *w = realloc(dns.watchers, (dns.nwatchers + 1) * sizeof(int));
+    if (w != NULL) {
+        w[dns.nwatchers++] = fd;
+        dns.watchers = w;
+    }
+    pthread_mutex_unlock(&dns.lock);
+    return w != NULL ? 0 : -1;
+}
+
+// Find a reverse entry, adding an unresolved one if there is none. Returns
+// NULL if the index is full of live entries. Caller holds dns.lock.
+static rdns_entry_t *find_rentry(const char *addr, const struct sockaddr *sa,
+                                 socklen_t salen, time_t t) {
+    uint64_t h = hash(addr);
+    rdns_entry_t **link = &dns.rbuckets[h % DNS_BUCKETS];
+    for (rdns_entry_t *e = *link; e != NULL; e = e->next) {
+        if (e->hash == h && strcmp(e->addr, addr) == 0)
+            return e;
+    }
+
+    // Make room by dropping stale entries nobody is using
+    for (int i = 0; dns.rcount >= DNS_MAX_ENTRIES && i < DNS_BUCKETS; i++) {
+        rdns_entry_t **l = &dns.rbuckets[i];
+        while (*l != NULL) {
+            rdns_entry_t *e = *l;
+            if (e->expires > t || e->resolving || e->queued) {
+                l = &e->next;
+                continue;
+            }
+            *l = e->next;
+            dns.rcount--;
+            free(e->addr);
+            free(e->name);
+            free(e);
+        }
+    }
+    if (dns.rcount >= DNS_MAX_ENTRIES)
+        return NULL;
+
+    rdns_entry_t *e = calloc(1, sizeof(rdns_entry_t));
+    if (e == NULL || (e->addr = strdup(addr)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->hash = h;
+    memcpy(&e->sa, sa, salen);
+    e->salen = salen;
+    e->next = *link;
+    *link = e;
+    dns.rcount++;
+    return e;
+}
+
+// Copy the cached name of a client address into name. Never blocks on the
+// resolver: an unknown or stale address is queued for the refresh thread,
+// and a stale name is still returned meanwhile. Returns false if no name is
+// known yet.
+bool dns_reverse(const struct sockaddr *sa, socklen_t salen, char *name,
+                 size_t len) {
+    char addr[NI_MAXHOST];
+
+    if (!dns.running || salen > sizeof(struct sockaddr_storage) ||
+        getnameinfo(sa, salen, addr, sizeof(addr), NULL, 0,
+                    NI_NUMERICHOST) != 0)
+        return false;
+
+    bool found = false;
+    time_t t = now();
+    pthread_mutex_lock(&dns.lock);
+    rdns_entry_t *e = find_rentry(addr, sa, salen, t);
+    if (e != NULL) {
+        if (e->name != NULL) {
+            snprintf(name, len, "%s", e->name);
+            found = true;
+        }
+        if (e->expires <= t && !e->resolving && !e->queued) {
+            e->queued = true;
+            e->qnext = dns.rqueue;
+            dns.rqueue = e;
+            pthread_cond_signal(&dns.refresh);
+        }
+    }
+    pthread_mutex_unlock(&dns.lock);
+    return found;
+}
+
+// Blocking connect to host:port through the cache, in place of
+// open_clientfd(). Returns a connected socket, or -1.
+int dns_connect(const char *host, const char *port) {
+    dns_addrs_t addrs;
+    if (dns_lookup(host, port, &addrs) < 0)
+        return -1;
+
+    for (int i = 0; i < addrs.naddrs; i++) {
+        struct sockaddr *sa = (struct sockaddr *)&addrs.addrs[i];
+        int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+        if (fd < 0)
+            continue;
+        if (connect(fd, sa, addrs.addrlens[i]) == 0)
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+// Stop the refresh thread and forget every name and address
+void dns_cache_free(void) {
+    pthread_mutex_lock(&dns.lock);
+    dns.stop = true;
+    pthread_cond_signal(&dns.refresh);
+    pthread_mutex_unlock(&dns.lock);
+    if (dns.running) {
+        pthread_join(dns.refresher, NULL);
+        dns.running = false;
+    }
+
+    pthread_mutex_lock(&dns.lock);
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        dns_entry_t *e = dns.buckets[i];
+        while (e != NULL) {
+            dns_entry_t *next = e->next;
+            free(e->host);
+            free(e);
+            e = next;
+        }
+        dns.buckets[i] = NULL;
+
+        rdns_entry_t *r = dns.rbuckets[i];
+        while (r != NULL) {
+            rdns_entry_t *next = r->next;
+            free(r->addr);
+            free(r->name);
+            free(r);
+            r = next;
+        }
+        dns.rbuckets[i] = NULL;
+    }
+    dns.count = 0;
+    dns.queue = NULL;
+    dns.rcount = 0;
+    dns.rqueue = NULL;
+    free(dns.watchers);
+    dns.watchers = NULL;
+    dns.nwatchers = 0;
+    pthread_mutex_unlock(&dns.lock);
+}
@@ -0,0 +1,34 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// In-process cache of upstream name lookups, consulted before getaddrinfo(),
+// and of client address names looked up in the background
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 1024 // Names cached at most
+#define DNS_MAX_ADDRS 8      // Addresses kept per name
+#define DEFAULT_DNS_TTL 60   // Seconds a resolved name is trusted
+#define DNS_NEGATIVE_TTL 5   // Seconds a failed lookup is remembered
+#define DNS_REFRESH_AHEAD 10 // Refresh names used this close to expiry
+#define DNS_PENDING 1        // dns_lookup_async(): resolving in background
+
+// Addresses of a name, with the port filled in by dns_lookup()
+typedef struct {
+    int naddrs;
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addrlens[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+int dns_cache_init(const char *hosts_file, int ttl);
+int dns_lookup(const char *host, const char *port, dns_addrs_t *out);
+int dns_lookup_async(const char *host, const char *port, dns_addrs_t *out);
+int dns_watch(int fd);
+int dns_connect(const char *host, const char *port);
+bool dns_reverse(const struct sockaddr *sa, socklen_t salen, char *name,
+                 size_t len);
+void dns_cache_free(void);
+
+#endif
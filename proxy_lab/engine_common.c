@@ -0,0 +1,547 @@
+#define _GNU_SOURCE // strptime(), timegm()
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "csapp.h"
+#include "engine_common.h"
+#include "proxy.h"
+
+// Headers that only describe one connection and must not be forwarded
+bool is_hop_header(const char *name, size_t len) {
+    static const char *const hop[] = {"Connection", "Proxy-Connection",
+                                      "Keep-Alive"};
+    for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); i++) {
+        if (strlen(hop[i]) == len && strncasecmp(name, hop[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Whether a comma separated header value such as "keep-alive, Upgrade"
+// contains token, ignoring case
+bool header_has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    while (*value != '\0') {
+        value += strspn(value, " \t\r\n,");
+        size_t n = strcspn(value, " \t\r\n,");
+        if (n == len && strncasecmp(value, token, len) == 0)
+            return true;
+        value += n;
+    }
+    return false;
+}
+
+// Classify one response header line ("Name: value\r\n"). Returns whether it
+// is a hop-by-hop header; if it is Content-Length, stores the length.
+bool response_line_is_hop(const char *line, long *content_length) {
+    const char *colon = strchr(line, ':');
+    if (colon == NULL)
+        return false;
+
+    size_t len = colon - line;
+    if (len == strlen("Content-Length") &&
+        strncasecmp(line, "Content-Length", len) == 0) {
+        char *end;
+        long value = strtol(colon + 1, &end, 10);
+        if (end != colon + 1 && value >= 0)
+            *content_length = value;
+        return false;
+    }
+    return is_hop_header(line, len);
+}
+
+// Locate the end of a stored response's head and read its framing. Returns
+// false if data does not start with a complete head.
+bool response_head_parse(const char *data, size_t len, resp_head_t *head) {
+    head->content_length = -1;
+    head->hop_headers = false;
+
+    const char *end = data + len;
+    const char *line = data;
+    bool first = true;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        if (nl == NULL)
+            return false;
+        size_t n = nl + 1 - line;
+        if ((n == 2 && line[0] == '\r') || n == 1) {
+            head->head_len = nl + 1 - data;
+            return true;
+        }
+        // Skip the status line, then copy each header to parse it
+        if (!first) {
+            char buf[MAXLINE];
+            if (n >= sizeof(buf))
+                n = sizeof(buf) - 1;
+            memcpy(buf, line, n);
+            buf[n] = '\0';
+            if (response_line_is_hop(buf, &head->content_length))
+                head->hop_headers = true;
+        }
+        first = false;
+        line = nl + 1;
+    }
+    return false;
+}
+
+// If line is a header called name, the start of its value. Leading blanks
+// are skipped; the value runs to the end of the line.
+static const char *header_value(const char *line, const char *name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) != 0 || line[len] != ':')
+        return NULL;
+    return line + len + 1 + strspn(line + len + 1, " \t");
+}
+
+// Length of a header value without its line ending or trailing blanks
+static size_t value_len(const char *value) {
+    size_t n = strcspn(value, "\r\n");
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t'))
+        n--;
+    return n;
+}
+
+// Parse an HTTP-date in its preferred IMF-fixdate form. Returns -1 if the
+// date is in another form or invalid.
+static time_t http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+// Seconds in a delta-seconds value such as max-age=60, -1 if none
+static long delta_seconds(const char *value) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    return end == value || n < 0 ? -1 : n;
+}
+
+void response_fresh_init(resp_fresh_t *fresh) {
+    fresh->date = -1;
+    fresh->expires = -1;
+    fresh->last_modified = -1;
+    fresh->max_age = -1;
+    fresh->s_maxage = -1;
+    fresh->age = -1;
+    fresh->no_cache = false;
+    fresh->no_store = false;
+}
+
+// Note one response header line ("Name: value\r\n") if it bears on
+// freshness. Later lines override earlier ones, so the headers of a 304 can
+// be applied over those of the stored response.
+void response_fresh_line(const char *line, resp_fresh_t *fresh) {
+    const char *value;
+    if ((value = header_value(line, "Date")) != NULL) {
+        fresh->date = http_date(value);
+    } else if ((value = header_value(line, "Expires")) != NULL) {
+        time_t t = http_date(value);
+        fresh->expires = t < 0 ? 0 : t;
+    } else if ((value = header_value(line, "Last-Modified")) != NULL) {
+        fresh->last_modified = http_date(value);
+    } else if ((value = header_value(line, "Age")) != NULL) {
+        fresh->age = delta_seconds(value);
+    } else if ((value = header_value(line, "Cache-Control")) != NULL) {
+        while (*value != '\0') {
+            value += strspn(value, " \t\r\n,");
+            size_t n = strcspn(value, " \t\r\n,");
+            if (n == 8 && strncasecmp(value, "no-cache", 8) == 0) {
+                fresh->no_cache = true;
+            } else if (n == 8 && strncasecmp(value, "no-store", 8) == 0) {
+                fresh->no_store = true;
+            } else if (n > 8 && strncasecmp(value, "max-age=", 8) == 0) {
+                fresh->max_age = delta_seconds(value + 8);
+            } else if (n > 9 && strncasecmp(value, "s-maxage=", 9) == 0) {
+                fresh->s_maxage = delta_seconds(value + 9);
+            }
+            value += n;
+        }
+    }
+}
+
+// When a response received at now becomes stale (RFC 9111, 4.2): after its
+// explicit lifetime from Cache-Control or Expires, else after a tenth of
+// the time since Last-Modified, else after RESPONSE_DEFAULT_TTL. The
+// lifetime counts from when the origin generated the response: now less its
+// initial age, the larger of its apparent age (now - Date) and its Age
+// header (4.2.3). no-cache and no-store responses are stale at once.
+time_t response_expiry(const resp_fresh_t *fresh, time_t now) {
+    if (fresh->no_cache || fresh->no_store)
+        return 0;
+
+    long age = fresh->age > 0 ? fresh->age : 0;
+    if (fresh->date >= 0 && fresh->date < now && now - fresh->date > age)
+        age = now - fresh->date;
+    time_t base = now - age;
+    long lifetime;
+    if (fresh->s_maxage >= 0) {
+        lifetime = fresh->s_maxage;
+    } else if (fresh->max_age >= 0) {
+        lifetime = fresh->max_age;
+    } else if (fresh->expires >= 0) {
+        time_t date = fresh->date >= 0 ? fresh->date : now;
+        lifetime = fresh->expires > date ? fresh->expires - date : 0;
+    } else if (fresh->last_modified >= 0 && fresh->last_modified < base) {
+        lifetime = (base - fresh->last_modified) / 10;
+        if (lifetime > RESPONSE_HEURISTIC_MAX)
+            lifetime = RESPONSE_HEURISTIC_MAX;
+    } else {
+        lifetime = RESPONSE_DEFAULT_TTL;
+    }
+    return base + lifetime;
+}
+
+// Read the validators and freshness headers of a stored response's head.
+// The validators point into data. Returns false if data does not start
+// with a complete head.
+bool response_meta_parse(const char *data, size_t len, resp_meta_t *meta) {
+    meta->etag = NULL;
+    meta->etag_len = 0;
+    meta->last_modified = NULL;
+    meta->last_modified_len = 0;
+    response_fresh_init(&meta->fresh);
+
+    const char *end = data + len;
+    const char *line = data;
+    bool first = true;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        if (nl == NULL)
+            return false;
+        size_t n = nl + 1 - line;
+        if ((n == 2 && line[0] == '\r') || n == 1)
+            return true;
+        if (!first) {
+            char buf[MAXLINE];
+            if (n >= sizeof(buf))
+                n = sizeof(buf) - 1;
+            memcpy(buf, line, n);
+            buf[n] = '\0';
+            response_fresh_line(buf, &meta->fresh);
+
+            const char *value;
+            if ((value = header_value(buf, "ETag")) != NULL) {
+                meta->etag = line + (value - buf);
+                meta->etag_len = value_len(value);
+            } else if ((value = header_value(buf, "Last-Modified")) != NULL) {
+                meta->last_modified = line + (value - buf);
+                meta->last_modified_len = value_len(value);
+            }
+        }
+        first = false;
+        line = nl + 1;
+    }
+    return false;
+}
+
+// Set fresh from the freshness headers of a stored response, so those of
+// a 304 revalidating it can be applied over them. fresh is left as it is
+// if the stored head does not parse.
+void response_stored_fresh(const cache_node_t *node, resp_fresh_t *fresh) {
+    resp_meta_t meta;
+    size_t len = node->size < SEGMENT_SIZE ? node->size : SEGMENT_SIZE;
+    if (len > 0 && response_meta_parse(node->data.segs[0], len, &meta))
+        *fresh = meta.fresh;
+}
+
+// Whether the client's request is conditional itself
+bool request_conditional(const req_t *req) {
+    return req_header(req, "If-None-Match") != NULL ||
+           req_header(req, "If-Modified-Since") != NULL;
+}
+
+// Whether a response may be stored: a 200 answering an unconditional
+// request. A 304, or anything else, answers the client's own question and
+// is not the object itself; no-store responses are never kept.
+bool response_storable(const req_t *req, int status, bool no_store) {
+    return status == 200 && !no_store && !request_conditional(req);
+}
+
+// Ends a head sent by an engine that closes after each response
+static const char head_close[] = "Connection: close\r\n\r\n";
+
+// Read the response head at the start of data, the len bytes received from
+// upstream so far. Once the head is complete, head->out is built for the
+// client: the upstream's hop-by-hop headers are dropped and the head ends
+// with head_close, followed by any body bytes that came with it.
+// head->fresh must be initialized by the caller. Returns 1 then, 0 if more
+// bytes are needed, and -1 if the head is malformed or larger than
+// RESPONSE_HEAD_MAX.
+int relay_head_parse(const char *data, size_t len, relay_head_t *head) {
+    const char *end = data + len;
+    const char *blank = data;
+    while (true) {
+        const char *nl = memchr(blank, '\n', end - blank);
+        if (nl == NULL)
+            return len >= RESPONSE_HEAD_MAX ? -1 : 0;
+        if (nl == blank || (nl == blank + 1 && blank[0] == '\r'))
+            break;
+        blank = nl + 1;
+    }
+    const char *body = (const char *)memchr(blank, '\n', end - blank) + 1;
+
+    head->status = 0;
+    head->content_length = -1;
+    head->no_store = false;
+    head->out = malloc(len + sizeof(head_close));
+    if (head->out == NULL)
+        return -1;
+
+    size_t n_out = 0;
+    for (const char *line = data; line < blank;) {
+        const char *nl = memchr(line, '\n', blank - line);
+        size_t n = nl + 1 - line;
+        char buf[MAXLINE];
+        size_t m = n < sizeof(buf) ? n : sizeof(buf) - 1;
+        memcpy(buf, line, m);
+        buf[m] = '\0';
+
+        bool keep = true;
+        const char *value;
+        if (line == data) {
+            int minor;
+            if (sscanf(buf, "HTTP/1.%d %d", &minor, &head->status) != 2) {
+                free(head->out);
+                head->out = NULL;
+                return -1;
+            }
+        } else if (response_line_is_hop(buf, &head->content_length)) {
+            keep = false;
+        } else {
+            response_fresh_line(buf, &head->fresh);
+            if ((value = header_value(buf, "Cache-Control")) != NULL &&
+                header_has_token(value, "no-store"))
+                head->no_store = true;
+        }
+        if (keep) {
+            memcpy(head->out + n_out, line, n);
+            n_out += n;
+        }
+        line = nl + 1;
+    }
+    head->kept_len = n_out;
+    memcpy(head->out + n_out, head_close, strlen(head_close));
+    n_out += strlen(head_close);
+    head->head_len = n_out;
+    memcpy(head->out + n_out, body, end - body);
+    head->out_len = n_out + (end - body);
+    return 1;
+}
+
+// The head of a cached response ending with head_close, for engines that
+// close after each response: a malloc'd string of *len bytes, after which
+// the body follows from offset *rest of data. Returns NULL if the head does
+// not parse, as for objects not framed by the proxy, which are sent as
+// stored.
+char *cached_head_close(const segbuf_t *data, size_t size, size_t *len,
+                        size_t *rest) {
+    resp_head_t head;
+    size_t first = size < SEGMENT_SIZE ? size : SEGMENT_SIZE;
+    if (size == 0 || !response_head_parse(data->segs[0], first, &head) ||
+        head.hop_headers)
+        return NULL;
+
+    // Stored heads end with a bare "\r\n"
+    size_t n = head.head_len - 2;
+    char *out = malloc(n + strlen(head_close));
+    if (out == NULL)
+        return NULL;
+    memcpy(out, data->segs[0], n);
+    memcpy(out + n, head_close, strlen(head_close));
+    *len = n + strlen(head_close);
+    *rest = head.head_len;
+    return out;
+}
+
+// Append a formatted string to a growable buffer
+static int buf_appendf(char **buf, size_t *len, size_t *cap, const char *fmt,
+                       ...) {
+    va_list ap;
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return -1;
+        if ((size_t)n < *cap - *len) {
+            *len += n;
+            return 0;
+        }
+        char *grown = realloc(*buf, *cap * 2);
+        if (grown == NULL)
+            return -1;
+        *buf = grown;
+        *cap *= 2;
+    }
+}
+
+// Append n bytes to a growable buffer
+static int buf_append(char **buf, size_t *len, size_t *cap, const char *s,
+                      size_t n) {
+    if (*len + n > *cap) {
+        size_t cap2 = *cap * 2;
+        while (cap2 < *len + n)
+            cap2 *= 2;
+        char *grown = realloc(*buf, cap2);
+        if (grown == NULL)
+            return -1;
+        *buf = grown;
+        *cap = cap2;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+// Render the request forwarded upstream as one buffer, so it goes out in a
+// single write. The client's hop-by-hop headers are replaced by
+// conn_headers. Headers are copied, not formatted.
+char *request_build(const req_t *req, const char *conn_headers, size_t *len) {
+    size_t cap = MAXLINE;
+    char *out = malloc(cap);
+
+    *len = 0;
+    if (out == NULL || buf_appendf(&out, len, &cap, "%s %s HTTP/1.0\r\n",
+                                   req->method, req->uri) < 0)
+        goto fail;
+    for (int i = 0; i < req->nheaders; i++) {
+        const req_header_t *header = &req->headers[i];
+        size_t name_len = strlen(header->name);
+        if (is_hop_header(header->name, name_len))
+            continue;
+        if (buf_append(&out, len, &cap, header->name, name_len) < 0 ||
+            buf_append(&out, len, &cap, ": ", 2) < 0 ||
+            buf_append(&out, len, &cap, header->value,
+                       strlen(header->value)) < 0 ||
+            buf_append(&out, len, &cap, "\r\n", 2) < 0)
+            goto fail;
+    }
+    if (buf_appendf(&out, len, &cap, "%s\r\n", conn_headers) < 0)
+        goto fail;
+    return out;
+
+fail:
+    free(out);
+    return NULL;
+}
+
+// Whether req is addressed to the proxy itself, on the connection fd it
+// arrived on: the port is the one the proxy listens on and the host a
+// loopback name, this machine's name, or the address fd was accepted on.
+// Forwarding such a request would only send it back to the proxy.
+bool request_for_proxy(const req_t *req, int fd) {
+    if ((req->port != NULL ? atoi(req->port) : 80) != listen_port)
+        return false;
+    const char *host = req->host;
+    if (strcasecmp(host, "localhost") == 0 || strncmp(host, "127.", 4) == 0 ||
+        strcmp(host, "::1") == 0)
+        return true;
+
+    char name[NI_MAXHOST];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        getnameinfo((struct sockaddr *)&addr, addrlen, name, sizeof(name),
+                    NULL, 0, NI_NUMERICHOST) == 0) {
+        // IPv4 clients of an IPv6 socket show up as mapped addresses
+        const char *local = name;
+        if (strncmp(local, "::ffff:", 7) == 0)
+            local += 7;
+        if (strcasecmp(host, local) == 0)
+            return true;
+    }
+    return gethostname(name, sizeof(name)) == 0 &&
+           strcasecmp(host, name) == 0;
+}
+
+// conn_headers followed by If-None-Match and If-Modified-Since carrying a
+// stale node's validators, to ask the origin for the object only if it
+// changed. Returns a malloc'd string, or NULL.
+char *revalidation_headers(const cache_node_t *node,
+                           const char *conn_headers) {
+    size_t cap = strlen(conn_headers) + node->etag_len +
+                 node->last_modified_len + 64;
+    char *out = malloc(cap);
+    if (out == NULL)
+        return NULL;
+
+    int len = snprintf(out, cap, "%s", conn_headers);
+    if (node->etag != NULL) {
+        len += snprintf(out + len, cap - len, "If-None-Match: %.*s\r\n",
+                        (int)node->etag_len, node->etag);
+    }
+    if (node->last_modified != NULL) {
+        snprintf(out + len, cap - len, "If-Modified-Since: %.*s\r\n",
+                 (int)node->last_modified_len, node->last_modified);
+    }
+    return out;
+}
+
+// Send small writes at once instead of waiting for the peer's ACK. Responses
+// and requests are written in as few calls as possible, so Nagle's algorithm
+// has nothing to coalesce and would only hold back the last segment.
+void socket_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Keep a copy of relayed bytes while the object may still be cached. The
+// copy grows a segment at a time up to max_object_size and is never moved,
+// and it becomes the cached object itself. Returns whether the bytes were
+// kept.
+bool objbuf_append(objbuf_t *ob, const char *data, size_t n) {
+    ob->len += n;
+    if (ob->len > max_object_size)
+        return false;
+    if (!segbuf_append(&ob->buf, data, n)) {
+        // Give up on caching this object
+        ob->len = max_object_size + 1;
+        return false;
+    }
+    return true;
+}
+
+// Same size rule as serve(): only objects below max_object_size are cached
+bool objbuf_cacheable(const objbuf_t *ob) {
+    return ob->len < max_object_size;
+}
+
+// Copy a relayed response's head into ob the way the cache stores it:
+// without the Connection header added for the client, ending with a bare
+// blank line. Body bytes that came with the head follow.
+void relay_head_store(const relay_head_t *head, objbuf_t *ob) {
+    objbuf_append(ob, head->out, head->kept_len);
+    objbuf_append(ob, "\r\n", 2);
+    if (head->out_len > head->head_len)
+        objbuf_append(ob, head->out + head->head_len,
+                      head->out_len - head->head_len);
+}
+
+// Whether a relayed response, copied into ob until the upstream closed, is
+// to be cached: storable, small enough and, if its length was announced,
+// complete
+bool relay_cacheable(const req_t *req, const relay_head_t *head,
+                     const objbuf_t *ob) {
+    size_t body = ob->len - (head->kept_len + 2);
+    return response_storable(req, head->status, head->no_store) &&
+           objbuf_cacheable(ob) &&
+           (head->content_length < 0 ||
+            body == (size_t)head->content_length);
+}
+
+void objbuf_free(objbuf_t *ob) {
+    segbuf_free(&ob->buf);
+    ob->len = 0;
+}
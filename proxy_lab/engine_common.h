@@ -0,0 +1,101 @@
+#ifndef ENGINE_COMMON_H
+#define ENGINE_COMMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "cache.h"
+#include "req_parser.h"
+#include "segment.h"
+
+// HTTP helpers shared by serve() and the non-blocking engines
+// (epoll_engine.c, uring_engine.c)
+
+// Appended to requests forwarded upstream in place of the client's
+// hop-by-hop headers: close after one response, or keep the connection for
+// the upstream pool
+#define UPSTREAM_CONNECTION_HEADERS                                            \
+    "Connection: close\r\nProxy-Connection: close\r\n"
+#define UPSTREAM_KEEP_ALIVE_HEADERS "Connection: keep-alive\r\n"
+
+// Lifetime in seconds of responses that carry no freshness information, and
+// the cap on a lifetime guessed from Last-Modified
+#define RESPONSE_DEFAULT_TTL 300
+#define RESPONSE_HEURISTIC_MAX (24 * 60 * 60)
+
+// Largest response head the event engines read before relaying it
+#define RESPONSE_HEAD_MAX SEGMENT_SIZE
+
+typedef struct {
+    segbuf_t buf; // Copy of the response while it may still be cached
+    size_t len;   // Total response bytes seen so far
+} objbuf_t;
+
+// Framing of a response stored in the cache
+typedef struct {
+    size_t head_len;     // Bytes up to and including the blank line
+    long content_length; // Content-Length, or -1 if absent
+    bool hop_headers;    // Head still carries Connection-type headers
+} resp_head_t;
+
+// Freshness headers of a response, -1 where absent
+typedef struct {
+    time_t date;          // Date
+    time_t expires;       // Expires, 0 if invalid (already expired)
+    time_t last_modified; // Last-Modified
+    long max_age;         // Cache-Control: max-age
+    long s_maxage;        // Cache-Control: s-maxage
+    long age;             // Age
+    bool no_cache;        // Cache-Control: no-cache
+    bool no_store;        // Cache-Control: no-store, never cached
+} resp_fresh_t;
+
+// A response head the event engines read before relaying the response.
+// Filled in by relay_head_parse() once the head is complete.
+typedef struct {
+    int status;          // Status code
+    long content_length; // Content-Length, or -1 if absent
+    bool no_store;       // Cache-Control: no-store
+    resp_fresh_t fresh;  // Freshness headers, applied over the caller's
+    char *out;           // malloc'd head for the client, then the body
+    size_t out_len;      // bytes that arrived with it
+    size_t kept_len;     // Status line and end-to-end headers, out's start
+    size_t head_len;     // Bytes of out up to its blank line
+} relay_head_t;
+
+// Validators and freshness of a stored response, from response_meta_parse()
+typedef struct {
+    const char *etag;          // ETag value inside the head, or NULL
+    size_t etag_len;
+    const char *last_modified; // Last-Modified value inside the head, or NULL
+    size_t last_modified_len;
+    resp_fresh_t fresh;
+} resp_meta_t;
+
+bool is_hop_header(const char *name, size_t len);
+bool header_has_token(const char *value, const char *token);
+bool response_line_is_hop(const char *line, long *content_length);
+bool response_head_parse(const char *data, size_t len, resp_head_t *head);
+void response_fresh_init(resp_fresh_t *fresh);
+void response_fresh_line(const char *line, resp_fresh_t *fresh);
+time_t response_expiry(const resp_fresh_t *fresh, time_t now);
+bool response_meta_parse(const char *data, size_t len, resp_meta_t *meta);
+void response_stored_fresh(const cache_node_t *node, resp_fresh_t *fresh);
+bool request_conditional(const req_t *req);
+bool response_storable(const req_t *req, int status, bool no_store);
+int relay_head_parse(const char *data, size_t len, relay_head_t *head);
+char *cached_head_close(const segbuf_t *data, size_t size, size_t *len,
+                        size_t *rest);
+char *request_build(const req_t *req, const char *conn_headers, size_t *len);
+char *revalidation_headers(const cache_node_t *node, const char *conn_headers);
+bool request_for_proxy(const req_t *req, int fd);
+void socket_nodelay(int fd);
+bool objbuf_append(objbuf_t *ob, const char *data, size_t n);
+bool objbuf_cacheable(const objbuf_t *ob);
+void relay_head_store(const relay_head_t *head, objbuf_t *ob);
+bool relay_cacheable(const req_t *req, const relay_head_t *head,
+                     const objbuf_t *ob);
+void objbuf_free(objbuf_t *ob);
+
+#endif
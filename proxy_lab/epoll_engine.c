@@ -0,0 +1,668 @@
+/*
+ * Event-driven engine for the proxy: each loop thread owns an epoll
+ * instance and drives every connection it accepted through a non-blocking
+ * state machine, instead of parking one blocked thread per socket.
+ *
+ *   READ_REQUEST -> (hit or 501) SEND_CLIENT -> close
+ *   READ_REQUEST -> CONNECTING -> SEND_REQUEST -> READ_HEAD -> RELAY -> close
+ *
+ * A request whose upstream name is not in the DNS cache waits in RESOLVING,
+ * off the epoll set, until the refresh thread signals the loop's eventfd.
+ *
+ * Request parsing goes through the same req_parser.c as serve(), hits and
+ * fills go through the same cache.c API, and stale hits are revalidated the
+ * same way. Client keep-alive, the upstream pool, flights and the idle
+ * timeout are thread-engine only: each connection here carries one request
+ * over a fresh upstream connection.
+ */
+
+#define _GNU_SOURCE // accept4()
+
+#include "epoll_engine.h"
+#include "cache.h"
+#include "csapp.h"
+#include "dns_cache.h"
+#include "engine_common.h"
+#include "log.h"
+#include "proxy.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64
+
+typedef enum {
+    CONN_READ_REQUEST, // Reading and parsing the request headers
+    CONN_RESOLVING,    // Waiting for the upstream name to resolve
+    CONN_SEND_CLIENT,  // Writing a canned reply or a cached object
+    CONN_CONNECTING,   // Waiting for the upstream connect to finish
+    CONN_SEND_REQUEST, // Forwarding the request to upstream
+    CONN_READ_HEAD,    // Reading the upstream response head
+    CONN_RELAY,        // Relaying the upstream response to the client
+} conn_state;
+
+typedef struct conn conn_t;
+
+/* One registered socket; epoll_event.data.ptr points at one of these. */
+typedef struct {
+    conn_t *conn;    // Owning connection, NULL for the listener and eventfd
+    int fd;          // Socket file descriptor, -1 when not open
+    uint32_t events; // Events currently registered, 0 if not registered
+} ev_handle_t;
+
+struct conn {
+    conn_state state;
+    ev_handle_t client;   // Client side
+    ev_handle_t server;   // Upstream side
+    req_t req;            // Request parsed in place in inbuf
+    char inbuf[MAXLINE];  // Request bytes read so far
+    size_t inlen;         // Number of bytes in inbuf
+    const char *wptr;     // Pending bytes for the current writer
+    size_t wlen;          // Number of pending bytes at wptr
+    char *reqbuf;         // Request forwarded upstream
+    char *relay;          // Relay buffer, allocated on a miss; holds the
+                          // response head first, RESPONSE_HEAD_MAX bytes
+    size_t relay_len;     // Bytes of the head read into relay
+    relay_head_t head;    // The response head, rewritten for the client
+    cache_node_t *cached; // Pinned cache node being sent, if any
+    cache_node_t *stale;  // Pinned stale node being revalidated, if any
+    bool revalidated;     // cached is a stale node the origin confirmed
+    size_t sent;          // Bytes of the cached node written so far
+    char *uri;            // Cache key of the request
+    objbuf_t obj;         // Copy of the response for the cache
+    uint64_t start;       // When the request head was parsed, in us
+    uint64_t connect_at;  // When the upstream connect began, in us
+    bool closed;          // Closed this round, freed after the batch
+    conn_t *next_free;    // Link in the loop's deferred free list
+    conn_t *next_parked;  // Link in the loop's list of RESOLVING conns
+};
+
+typedef struct {
+    int epfd;           // This loop's epoll instance
+    ev_handle_t listen; // The shared listening socket
+    ev_handle_t wake;   // eventfd the DNS cache signals after a lookup
+    conn_t *parked;     // Connections waiting for a name to resolve
+    conn_t *to_free;    // Connections closed during the current batch
+} ev_loop_t;
+
+// Switch a descriptor to non-blocking mode
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Register or update interest in events for one handle. Passing 0 removes
+// the fd from the set entirely, so a paused socket cannot keep reporting
+// EPOLLHUP or EPOLLERR.
+static void watch(ev_loop_t *loop, ev_handle_t *h, uint32_t events) {
+    if (h->fd < 0 || h->events == events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = h;
+    if (events == 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, h->fd, &ev);
+    } else if (h->events == 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, h->fd, &ev);
+    } else {
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, h->fd, &ev);
+    }
+    h->events = events;
+}
+
+// Close both sockets and release a connection's resources. The struct
+// itself is freed after the current batch, because later events in the
+// same batch may still point at its handles.
+static void conn_close(ev_loop_t *loop, conn_t *c) {
+    if (c->closed)
+        return;
+    c->closed = true;
+
+    if (c->client.fd >= 0)
+        close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    if (c->cached != NULL)
+        put_cache_node(c->cached);
+    if (c->stale != NULL)
+        put_cache_node(c->stale);
+    free(c->reqbuf);
+    free(c->relay);
+    free(c->head.out);
+    free(c->uri);
+    objbuf_free(&c->obj);
+
+    c->next_free = loop->to_free;
+    loop->to_free = c;
+}
+
+// Write pending bytes to fd. Returns 1 when everything was written, 0 if the
+// socket would block and -1 on error.
+static int flush_pending(conn_t *c, int fd) {
+    while (c->wlen > 0) {
+        ssize_t n = write(fd, c->wptr, c->wlen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->wptr += n;
+        c->wlen -= n;
+    }
+    return 1;
+}
+
+// Write the rest of the cached node, a batch of segments per writev().
+// Returns like flush_pending().
+static int flush_cached(conn_t *c, int fd) {
+    const cache_node_t *node = c->cached;
+    struct iovec iov[SEGMENT_IOVS];
+    while (c->sent < node->size) {
+        int iovcnt = SEGMENT_IOVS;
+        segbuf_iov(&node->data, c->sent, node->size - c->sent, iov, &iovcnt);
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->sent += n;
+    }
+    return 1;
+}
+
+// Send the pending reply, or a cached node after its rewritten head, and
+// close once it is out
+static void send_client(ev_loop_t *loop, conn_t *c) {
+    int rc = flush_pending(c, c->client.fd);
+    if (rc == 1 && c->cached != NULL)
+        rc = flush_cached(c, c->client.fd);
+    if (rc == 0) {
+        watch(loop, &c->client, EPOLLOUT);
+    } else {
+        if (rc == 1 && c->cached != NULL) {
+            uint64_t elapsed = stats_now_us() - c->start;
+            stats_record(HIST_TTFB, elapsed);
+            stats_record(HIST_TOTAL, elapsed);
+            log_info(c->revalidated ? "Revalidated cached response for: %s\n"
+                                    : "Served from cache: %s\n",
+                     c->uri);
+        }
+        conn_close(loop, c);
+    }
+}
+
+// Start sending a reply that needs no upstream
+static void start_reply(ev_loop_t *loop, conn_t *c, const char *data,
+                        size_t len) {
+    c->state = CONN_SEND_CLIENT;
+    c->wptr = data;
+    c->wlen = len;
+    send_client(loop, c);
+}
+
+// Send the pinned node c->cached. Its stored head gets a Connection header,
+// the body follows as is.
+static void start_cached(ev_loop_t *loop, conn_t *c) {
+    cache_count(true, c->cached->size);
+    c->reqbuf = cached_head_close(&c->cached->data, c->cached->size, &c->wlen,
+                                  &c->sent);
+    c->wptr = c->reqbuf;
+    c->state = CONN_SEND_CLIENT;
+    send_client(loop, c);
+}
+
+// Begin a non-blocking connect to the first usable address
+static int start_connect(const dns_addrs_t *addrs) {
+    int fd = -1;
+
+    for (int i = 0; i < addrs->naddrs; i++) {
+        struct sockaddr *sa = (struct sockaddr *)&addrs->addrs[i];
+        fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+            continue;
+        socket_nodelay(fd);
+        if (connect(fd, sa, addrs->addrlens[i]) == 0 || errno == EINPROGRESS)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Connect to the request's upstream. A name missing from the DNS cache is
+// left to the refresh thread, and the connection parked until it is done.
+static void connect_upstream(ev_loop_t *loop, conn_t *c) {
+    const char *host = c->req.host;
+    const char *port = c->req.port != NULL ? c->req.port : "80";
+    dns_addrs_t addrs;
+
+    int rc = dns_lookup_async(host, port, &addrs);
+    if (rc == DNS_PENDING) {
+        c->state = CONN_RESOLVING;
+        watch(loop, &c->client, 0);
+        c->next_parked = loop->parked;
+        loop->parked = c;
+        return;
+    }
+    c->connect_at = stats_now_us();
+    c->server.fd = rc == 0 ? start_connect(&addrs) : -1;
+    if (c->server.fd < 0) {
+        log_warn("Failed to connect to remote server: %s:%s\n", host, port);
+        conn_close(loop, c);
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    watch(loop, &c->client, 0);
+    watch(loop, &c->server, EPOLLOUT);
+}
+
+// A lookup finished: retry every parked connection. Those whose name is
+// still pending park again.
+static void resume_parked(ev_loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_warn("eventfd read: %s\n", strerror(errno));
+
+    conn_t *c = loop->parked;
+    loop->parked = NULL;
+    while (c != NULL) {
+        conn_t *next = c->next_parked;
+        connect_upstream(loop, c);
+        c = next;
+    }
+}
+
+// The request headers are complete: answer from the cache or go upstream
+static void start_request(ev_loop_t *loop, conn_t *c) {
+    const char *uri = c->req.uri;
+    bool json;
+    bool self = request_for_proxy(&c->req, c->client.fd);
+
+    c->start = stats_now_us();
+    if (stats_is_request(self ? c->req.path : uri, &json)) {
+        size_t len;
+        if ((c->reqbuf = stats_response(json, &len)) == NULL) {
+            conn_close(loop, c);
+            return;
+        }
+        start_reply(loop, c, c->reqbuf, len);
+        return;
+    }
+    if (self) {
+        log_warn("Request loops back to the proxy: %s\n", uri);
+        conn_close(loop, c);
+        return;
+    }
+
+    c->uri = strdup(uri);
+    if (c->uri == NULL) {
+        conn_close(loop, c);
+        return;
+    }
+
+    // Cache hit: send the pinned node straight from the cache. As in
+    // serve(), a stale node is revalidated upstream if it has validators,
+    // unless the client's request is conditional itself; otherwise it is
+    // fetched again in full and the new copy replaces it.
+    if ((c->cached = get_cache_node(uri)) != NULL &&
+        !cache_node_fresh(c->cached)) {
+        if ((c->cached->etag != NULL || c->cached->last_modified != NULL) &&
+            !request_conditional(&c->req))
+            c->stale = c->cached;
+        else
+            put_cache_node(c->cached);
+        c->cached = NULL;
+    }
+    if (c->cached != NULL) {
+        start_cached(loop, c);
+        return;
+    }
+
+    char *conditional = NULL;
+    if (c->stale != NULL &&
+        (conditional = revalidation_headers(
+             c->stale, UPSTREAM_CONNECTION_HEADERS)) == NULL) {
+        put_cache_node(c->stale);
+        c->stale = NULL;
+    }
+    size_t reqlen;
+    c->reqbuf = request_build(
+        &c->req,
+        conditional != NULL ? conditional : UPSTREAM_CONNECTION_HEADERS,
+        &reqlen);
+    free(conditional);
+    c->relay = malloc(RESPONSE_HEAD_MAX);
+    // The headers of a 304 are applied over those of the stale copy
+    response_fresh_init(&c->head.fresh);
+    if (c->stale != NULL)
+        response_stored_fresh(c->stale, &c->head.fresh);
+    if (c->reqbuf == NULL || c->relay == NULL) {
+        conn_close(loop, c);
+        return;
+    }
+    c->wptr = c->reqbuf;
+    c->wlen = reqlen;
+    connect_upstream(loop, c);
+}
+
+// Read from the client and parse the new bytes where they landed
+static void read_request(ev_loop_t *loop, conn_t *c) {
+    ssize_t n = read(c->client.fd, c->inbuf + c->inlen,
+                     sizeof(c->inbuf) - c->inlen);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        // Client closed the connection before completing the request
+        conn_close(loop, c);
+        return;
+    }
+    c->inlen += n;
+
+    switch (req_parse(&c->req, c->inbuf, c->inlen)) {
+    case REQ_COMPLETE:
+        start_request(loop, c);
+        break;
+    case REQ_UNSUPPORTED:
+        start_reply(loop, c, response_501, strlen(response_501));
+        break;
+    case REQ_ERROR:
+        log_warn("Malformed request\n");
+        conn_close(loop, c);
+        break;
+    case REQ_INCOMPLETE:
+        if (c->inlen == sizeof(c->inbuf)) {
+            log_warn("Request head too large\n");
+            conn_close(loop, c);
+        }
+        break;
+    }
+}
+
+// Check the outcome of the asynchronous connect
+static void finish_connect(ev_loop_t *loop, conn_t *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        log_warn("Failed to connect to remote server\n");
+        conn_close(loop, c);
+        return;
+    }
+    stats_add(STAT_CONNECTS, 1);
+    stats_record(HIST_CONNECT, stats_now_us() - c->connect_at);
+    c->state = CONN_SEND_REQUEST;
+}
+
+// Forward the request, then wait for the response head
+static void send_request(ev_loop_t *loop, conn_t *c) {
+    int rc = flush_pending(c, c->server.fd);
+    if (rc < 0) {
+        log_warn("Lost server connection\n");
+        conn_close(loop, c);
+    } else if (rc == 1) {
+        free(c->reqbuf);
+        c->reqbuf = NULL;
+        c->state = CONN_READ_HEAD;
+        watch(loop, &c->server, EPOLLIN);
+    }
+}
+
+// Flush relayed bytes to the client, pausing upstream reads meanwhile
+static void relay_to_client(ev_loop_t *loop, conn_t *c) {
+    int rc = flush_pending(c, c->client.fd);
+    if (rc < 0) {
+        log_warn("Client closed connection while sending response\n");
+        conn_close(loop, c);
+    } else if (rc == 0) {
+        watch(loop, &c->server, 0);
+        watch(loop, &c->client, EPOLLOUT);
+    } else {
+        watch(loop, &c->client, 0);
+        watch(loop, &c->server, EPOLLIN);
+    }
+}
+
+// Read the response head. A 304 confirms a stale copy being revalidated,
+// which is then sent instead. Otherwise the copy for the cache starts with
+// the head's stored form, and the rewritten head goes to the client with
+// any body bytes that came along.
+static void read_head(ev_loop_t *loop, conn_t *c) {
+    ssize_t n = read(c->server.fd, c->relay + c->relay_len,
+                     RESPONSE_HEAD_MAX - c->relay_len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        log_warn("Lost server connection\n");
+        conn_close(loop, c);
+        return;
+    }
+    c->relay_len += n;
+
+    int rc = relay_head_parse(c->relay, c->relay_len, &c->head);
+    if (rc == 0)
+        return;
+    if (rc < 0) {
+        log_warn("Malformed or oversized response head\n");
+        conn_close(loop, c);
+        return;
+    }
+    if (c->stale != NULL) {
+        if (c->head.status == 304) {
+            // Still current: extend its lifetime, the origin sent no body
+            cache_node_refresh(c->stale,
+                               response_expiry(&c->head.fresh, time(NULL)));
+            watch(loop, &c->server, 0);
+            close(c->server.fd);
+            c->server.fd = -1;
+            c->cached = c->stale;
+            c->stale = NULL;
+            c->revalidated = true;
+            start_cached(loop, c);
+            return;
+        }
+        // The object changed: the full response replaces the copy
+        put_cache_node(c->stale);
+        c->stale = NULL;
+    }
+    stats_record(HIST_TTFB, stats_now_us() - c->start);
+    relay_head_store(&c->head, &c->obj);
+    c->wptr = c->head.out;
+    c->wlen = c->head.out_len;
+    c->state = CONN_RELAY;
+    relay_to_client(loop, c);
+}
+
+// Read one chunk from upstream and pass it on
+static void relay_from_server(ev_loop_t *loop, conn_t *c) {
+    ssize_t n = read(c->server.fd, c->relay, CHUNK_SIZE);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n < 0) {
+        log_warn("Lost server connection\n");
+        conn_close(loop, c);
+        return;
+    }
+    if (n == 0) {
+        // Response complete
+        stats_record(HIST_TOTAL, stats_now_us() - c->start);
+        cache_count(false, c->obj.len);
+        if (relay_cacheable(&c->req, &c->head, &c->obj) &&
+            add_cache_node(c->uri, &c->obj.buf))
+            log_info("Cached response for: %s\n", c->uri);
+        conn_close(loop, c);
+        return;
+    }
+
+    objbuf_append(&c->obj, c->relay, n);
+    c->wptr = c->relay;
+    c->wlen = n;
+    relay_to_client(loop, c);
+}
+
+// Dispatch one epoll event to the connection's state machine
+static void conn_event(ev_loop_t *loop, ev_handle_t *h, uint32_t events) {
+    conn_t *c = h->conn;
+    if (c->closed)
+        return;
+    if (h == &c->client && (events & (EPOLLERR | EPOLLHUP))) {
+        conn_close(loop, c);
+        return;
+    }
+
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        read_request(loop, c);
+        break;
+    case CONN_RESOLVING:
+        // Off the epoll set until resume_parked()
+        break;
+    case CONN_SEND_CLIENT:
+        send_client(loop, c);
+        break;
+    case CONN_CONNECTING:
+        finish_connect(loop, c);
+        if (!c->closed)
+            send_request(loop, c);
+        break;
+    case CONN_SEND_REQUEST:
+        send_request(loop, c);
+        break;
+    case CONN_READ_HEAD:
+        read_head(loop, c);
+        break;
+    case CONN_RELAY:
+        if (h == &c->server)
+            relay_from_server(loop, c);
+        else
+            relay_to_client(loop, c);
+        break;
+    }
+}
+
+// Accept a batch of pending connections onto this loop
+static void accept_conns(ev_loop_t *loop) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int fd = accept4(loop->listen.fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_warn("accept: %s\n", strerror(errno));
+            return;
+        }
+        socket_nodelay(fd);
+
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (c == NULL) {
+            log_warn("Failed to initialize connection\n");
+            close(fd);
+            continue;
+        }
+        req_init(&c->req);
+        c->state = CONN_READ_REQUEST;
+        c->client.conn = c;
+        c->client.fd = fd;
+        c->server.conn = c;
+        c->server.fd = -1;
+        watch(loop, &c->client, EPOLLIN);
+    }
+}
+
+// One event loop; every loop shares the listening socket
+static void *event_loop(void *vargp) {
+    ev_loop_t *loop = (ev_loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            ev_handle_t *h = events[i].data.ptr;
+            if (h == &loop->listen)
+                accept_conns(loop);
+            else if (h == &loop->wake)
+                resume_parked(loop);
+            else
+                conn_event(loop, h, events[i].events);
+        }
+
+        // Free connections closed during this batch
+        while (loop->to_free != NULL) {
+            conn_t *next = loop->to_free->next_free;
+            free(loop->to_free);
+            loop->to_free = next;
+        }
+    }
+    return NULL;
+}
+
+// Run nloops event loops on listenfd. Only returns on a setup failure.
+int epoll_engine_run(int listenfd, int nloops) {
+    if (set_nonblocking(listenfd) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    ev_loop_t *loops = calloc(nloops, sizeof(ev_loop_t));
+    if (loops == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (int i = 0; i < nloops; i++) {
+        ev_loop_t *loop = &loops[i];
+        loop->epfd = epoll_create1(0);
+        if (loop->epfd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+        // EPOLLEXCLUSIVE wakes only one loop per incoming connection
+        loop->listen.fd = listenfd;
+        watch(loop, &loop->listen, EPOLLIN | EPOLLEXCLUSIVE);
+
+        loop->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wake.fd < 0 || dns_watch(loop->wake.fd) < 0) {
+            perror("eventfd");
+            return -1;
+        }
+        watch(loop, &loop->wake, EPOLLIN);
+    }
+
+    log_info("epoll engine: %d event loops\n", nloops);
+    for (int i = 1; i < nloops; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, event_loop, &loops[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    event_loop(&loops[0]);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+int epoll_engine_run(int listenfd, int nloops);
+
+#endif
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_BATCH_SIZE (64 * 1024)
+
+typedef struct {
+    uint8_t level;
+    uint16_t len; // Bytes of text, ending in a newline
+    char text[LOG_RECORD_SIZE - 4];
+} log_record_t;
+
+// One thread's pending messages. The owner advances head, the flusher
+// advances tail, so neither needs a lock.
+typedef struct log_ring {
+    _Atomic uint32_t head;    // Next slot the owner fills
+    _Atomic uint32_t tail;    // Next slot the flusher takes
+    _Atomic uint64_t dropped; // Messages lost to a full ring
+    uint64_t reported;        // Drops already reported, flusher only
+    struct log_ring *next;    // Next registered thread
+    log_record_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+// Every thread that ever logged; rings are never freed since the proxy's
+// threads live as long as the process
+static log_ring_t *_Atomic all_rings;
+static __thread log_ring_t *ring;
+
+static int out_fd = STDOUT_FILENO; // Debug and info messages
+static int err_fd = STDERR_FILENO; // Warnings and errors
+static pthread_t flusher;
+static atomic_bool running;
+static atomic_bool stopping;
+
+// Write all of buf to fd, giving up on errors other than EINTR
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Messages for one descriptor, written once the batch is full or drained
+typedef struct {
+    int fd;
+    size_t len;
+    char data[LOG_BATCH_SIZE];
+} log_batch_t;
+
+static void batch_add(log_batch_t *b, const char *text, size_t len) {
+    if (b->len + len > sizeof(b->data)) {
+        write_all(b->fd, b->data, b->len);
+        b->len = 0;
+    }
+    memcpy(b->data + b->len, text, len);
+    b->len += len;
+}
+
+static void batch_flush(log_batch_t *b) {
+    if (b->len > 0)
+        write_all(b->fd, b->data, b->len);
+    b->len = 0;
+}
+
+// Move every pending message into the batches
+static void drain(log_batch_t *out, log_batch_t *err) {
+    for (log_ring_t *r = atomic_load(&all_rings); r != NULL; r = r->next) {
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            const log_record_t *rec = &r->slots[tail % LOG_RING_SLOTS];
+            batch_add(rec->level >= LOG_WARN ? err : out, rec->text,
+                      rec->len);
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+        uint64_t dropped =
+            atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->reported) {
+            char note[64];
+            int n = snprintf(note, sizeof(note),
+                             "log: %llu messages dropped\n",
+                             (unsigned long long)(dropped - r->reported));
+            batch_add(err, note, n);
+            r->reported = dropped;
+        }
+    }
+}
+
+// Background thread: collect the rings every LOG_FLUSH_MS until
+// log_shutdown(), so a busy proxy pays one write per descriptor per round
+static void *flush_loop(void *vargp) {
+    static log_batch_t out, err;
+    out.fd = out_fd;
+    err.fd = err_fd;
+
+    while (true) {
+        bool stop = atomic_load(&stopping);
+        drain(&out, &err);
+        batch_flush(&out);
+        batch_flush(&err);
+        if (stop)
+            break;
+        struct timespec ts = {0, LOG_FLUSH_MS * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+// The calling thread's ring, registered on first use. NULL if out of memory.
+static log_ring_t *get_ring(void) {
+    if (ring == NULL && (ring = calloc(1, sizeof(log_ring_t))) != NULL) {
+        log_ring_t *first = atomic_load(&all_rings);
+        do {
+            ring->next = first;
+        } while (!atomic_compare_exchange_weak(&all_rings, &first, ring));
+    }
+    return ring;
+}
+
+// Start the background writer. Messages go to path, or to stdout and
+// stderr by level if path is NULL. Pending messages are written at exit.
+int log_init(const char *path) {
+    if (path != NULL) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+        out_fd = err_fd = fd;
+    }
+    // Keep anything already printed ahead of the queued messages
+    fflush(stdout);
+
+    // The writer never handles signals, whatever the proxy blocks later
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&flusher, NULL, flush_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+        return -1;
+    atomic_store(&running, true);
+    atexit(log_shutdown);
+    return 0;
+}
+
+// Queue one message. fmt should end in a newline, one is added to messages
+// cut short. Before log_init() messages are written directly.
+void log_write(log_level_t level, const char *fmt, ...) {
+    va_list ap;
+    log_ring_t *r;
+
+    if (!atomic_load_explicit(&running, memory_order_relaxed) ||
+        (r = get_ring()) == NULL) {
+        va_start(ap, fmt);
+        vfprintf(level >= LOG_WARN ? stderr : stdout, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SLOTS) {
+        // Single writer, so a plain load and store is enough
+        atomic_store_explicit(
+            &r->dropped,
+            atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+        return;
+    }
+
+    log_record_t *rec = &r->slots[head % LOG_RING_SLOTS];
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof(rec->text)) {
+        n = sizeof(rec->text) - 1;
+        rec->text[n - 1] = '\n';
+    }
+    rec->level = level;
+    rec->len = n;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// Stop the background writer after it writes everything queued so far
+void log_shutdown(void) {
+    if (!atomic_exchange(&running, false))
+        return;
+    atomic_store(&stopping, true);
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,39 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous logger. Each thread formats its messages into its own ring
+// without locks or system calls; a background thread collects the rings and
+// writes them out in batches. Messages are dropped, and counted, when a
+// thread's ring is full rather than making the caller wait.
+typedef enum {
+    LOG_DEBUG, // Per-request details
+    LOG_INFO,  // Per-request outcomes
+    LOG_WARN,  // Failed requests and connections
+    LOG_ERROR, // Failures that affect the whole proxy
+} log_level_t;
+
+// Calls below this level compile to nothing, arguments included
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+#define LOG_RECORD_SIZE 256 // Bytes per message, longer ones are cut short
+#define LOG_RING_SLOTS 2048 // Messages a thread can have pending
+#define LOG_FLUSH_MS 5      // How often the background thread writes
+
+#define log_at(level, ...)                                                     \
+    do {                                                                       \
+        if ((level) >= LOG_MIN_LEVEL)                                          \
+            log_write(level, __VA_ARGS__);                                     \
+    } while (0)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+int log_init(const char *path);
+void log_write(log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_shutdown(void);
+
+#endif
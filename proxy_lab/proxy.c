@@ -6,9 +6,22 @@
 
 /* Some useful includes to help you get started */
 
+#define _GNU_SOURCE // splice()
+
 #include "cache.h"
+#include "conn_pool.h"
 #include "csapp.h"
-#include "http_parser.h"
+#include "disk_cache.h"
+#include "dns_cache.h"
+#include "engine_common.h"
+#include "epoll_engine.h"
+#include "log.h"
+#include "proxy.h"
+#include "req_parser.h"
+#include "sbuf.h"
+#include "segment.h"
+#include "stats.h"
+#include "uring_engine.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -18,15 +31,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -40,15 +57,12 @@
 #define dbg_printf(...)
 #endif
 
-/*
- * Max cache and object sizes
- * You might want to move these to the file containing your cache implementation
- */
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
 #define HOSTLEN 256
 #define SERVLEN 8
-#define CHUNK_SIZE 4096
+#define DEFAULT_WORKERS 16
+#define DEFAULT_QUEUE_DEPTH 256
+#define DEFAULT_IDLE_TIMEOUT 5
+#define SPLICE_CHUNK (64 * 1024)
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
@@ -62,6 +76,13 @@ typedef struct {
     char serv[SERVLEN];      // Client service (port)
 } client_info;
 
+/* Request bytes read from a client connection, parsed in place. */
+typedef struct {
+    char data[MAXLINE]; // The current request's head first
+    size_t len;         // Bytes in data
+    size_t used;        // Head of the request being served, dropped next
+} client_input;
+
 /* URI parsing results. */
 typedef enum { PARSE_ERROR, PARSE_STATIC, PARSE_DYNAMIC } parse_result;
 
@@ -78,248 +99,1002 @@ void sigpipe_handler(int sig) {
     return;
 }
 
+const char response_501[] =
+    "HTTP/1.0 501 Not Implemented\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 135\r\n"
+    "\r\n"
+    "<html><head><title>501 Not Implemented</title></head>"
+    "<body><h1>501 Not Implemented</h1>"
+    "<p>The requested method is not supported by this proxy "
+    "server.</p></body></html>";
+
 void send_501_not_implemented(int clientfd) {
-    const char *response =
-        "HTTP/1.0 501 Not Implemented\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: 135\r\n"
-        "\r\n"
-        "<html><head><title>501 Not Implemented</title></head>"
-        "<body><h1>501 Not Implemented</h1>"
-        "<p>The requested method is not supported by this proxy "
-        "server.</p></body></html>";
-
-    rio_writen(clientfd, response, strlen(response));
+    rio_writen(clientfd, response_501, strlen(response_501));
 }
 
+/* Cache budget and largest cached object, see proxy.h */
+size_t max_cache_size = DEFAULT_CACHE_SIZE;
+size_t max_object_size = DEFAULT_OBJECT_SIZE;
+int listen_port;
+
+/* Accepted connections waiting for a worker */
+static sbuf_t conn_queue;
+
+/* Seconds a persistent client connection may sit idle, 0 disables reuse */
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+/* Cache snapshot file, NULL if snapshots are disabled */
+static const char *snapshot_file = NULL;
+
+static const char conn_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char conn_close[] = "Connection: close\r\n\r\n";
+
 /*
- * serve - handle one HTTP request/response transaction
+ * sendv_all - send every byte described by iov on a socket, retrying short
+ * writes. flags are passed to sendmsg(), e.g. MSG_MORE when more data
+ * follows at once. iov is modified. Returns 0 on success and -1 on error.
  */
-void *serve(void *vargp) {
-    client_info *client = (client_info *)vargp;
-    pthread_detach(pthread_self());
-    // Initiate client RIO and parser
-    rio_t rio;
-    parser_state state;
-    parser_t *parser = parser_new();
-    if (parser == NULL) {
-        fprintf(stderr, "Failed to initialize parser\n");
-        return NULL;
-    }
-    rio_readinitb(&rio, client->connfd);
-
-    // Read request line
-    char buf[MAXLINE];
-    while (1) {
-        ssize_t n = rio_readlineb(&rio, buf, MAXLINE);
-        if (n == 0) {
-            // EOF: Client closed connection before completing the request
-            fprintf(stderr, "Client closed the connection before sending the "
-                            "complete request\n");
-            parser_free(parser);
-            return NULL;
-        } else if (n < 0) {
-            // Error during read
-            fprintf(stderr, "Error reading from client socket\n");
-            parser_free(parser);
-            return NULL;
+static int sendv_all(int fd, struct iovec *iov, int iovcnt, int flags) {
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 
-        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
-            // End of headers
+/*
+ * send_segments - send len bytes of a segmented object starting at offset,
+ * gathering up to SEGMENT_IOVS segments into each sendmsg(). tail, if not
+ * NULL, is sent right after them in the same call as the last segments.
+ * flags are passed to the last call, earlier ones add MSG_MORE. Returns 0
+ * on success and -1 on error.
+ */
+static int send_segments(int fd, const segbuf_t *sb, size_t offset,
+                         size_t len, const char *tail, int flags) {
+    struct iovec iov[SEGMENT_IOVS + 1];
+    do {
+        int iovcnt = SEGMENT_IOVS;
+        size_t n = segbuf_iov(sb, offset, len, iov, &iovcnt);
+        offset += n;
+        len -= n;
+        if (len == 0 && tail != NULL)
+            iov[iovcnt++] = (struct iovec){(void *)tail, strlen(tail)};
+        if (sendv_all(fd, iov, iovcnt, len > 0 ? flags | MSG_MORE : flags) <
+            0)
+            return -1;
+    } while (len > 0);
+    return 0;
+}
+
+/*
+ * splice_relay - move up to remaining bytes (all of them until EOF if
+ * remaining < 0) from the server to the client without copying them through
+ * user space: bytes already buffered in rio are written first, the rest go
+ * socket to pipe to socket with splice(). Falls back to read/write if the
+ * descriptors do not support splicing. Stores the bytes moved in *moved and
+ * returns 0 at the end of the body or on EOF, -1 on error.
+ */
+static int splice_relay(rio_t *rio, int connfd, long remaining, long *moved) {
+    int pipefd[2];
+    char buf[CHUNK_SIZE];
+    int rc = 0;
+
+    *moved = 0;
+    if (rio->rio_cnt > 0) {
+        long n = rio->rio_cnt;
+        if (remaining >= 0 && n > remaining)
+            n = remaining;
+        if (rio_writen(connfd, rio->rio_bufptr, n) < 0)
+            return -1;
+        rio->rio_bufptr += n;
+        rio->rio_cnt -= n;
+        *moved += n;
+        if (remaining > 0)
+            remaining -= n;
+    }
+    bool have_pipe = pipe2(pipefd, O_CLOEXEC) == 0;
+    bool use_splice = have_pipe;
+
+    while (remaining != 0) {
+        size_t want = SPLICE_CHUNK;
+        if (remaining > 0 && remaining < SPLICE_CHUNK)
+            want = remaining;
+
+        ssize_t n;
+        if (use_splice) {
+            n = splice(rio->rio_fd, NULL, pipefd[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL && *moved == 0) {
+                // Not spliceable, copy instead
+                use_splice = false;
+                continue;
+            }
+        } else {
+            n = read(rio->rio_fd, buf, want < sizeof(buf) ? want : sizeof(buf));
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rc = n < 0 ? -1 : 0;
             break;
         }
 
-        state = parser_parse_line(parser, buf);
-        if (state == ERROR) {
-            fprintf(stderr, "Error parsing line: %s\n", buf);
-            parser_free(parser);
-            return NULL;
+        if (use_splice) {
+            // Drain the pipe completely so it is empty for the next round
+            for (ssize_t left = n; left > 0;) {
+                ssize_t m = splice(pipefd[0], NULL, connfd, NULL, left,
+                                   SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m <= 0) {
+                    rc = -1;
+                    break;
+                }
+                left -= m;
+            }
+        } else if (rio_writen(connfd, buf, n) < 0) {
+            rc = -1;
         }
+        if (rc < 0)
+            break;
+        *moved += n;
+        if (remaining > 0)
+            remaining -= n;
     }
 
-    // Initialize values
-    const char *method = NULL;
-    const char *uri = NULL;
-    const char *host = NULL;
-    const char *port = NULL;
-    // const char *path = NULL;
-    const char *http_version = NULL;
+    if (have_pipe) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return rc;
+}
 
-    if (parser_retrieve(parser, METHOD, &method) == 0) {
-        printf("Method: %s\n", method);
-    } else {
-        if (strcmp(method, "GET") != 0) {
-            send_501_not_implemented(client->connfd);
-            parser_free(parser);
-            return NULL;
-        } else {
-            fprintf(stderr, "METHOD not implemented\n");
-            parser_free(parser);
-            return NULL;
-        }
+/*
+ * client_keep_alive - whether the client asked for a persistent connection:
+ * the default for HTTP/1.1, opt-in with "keep-alive" for HTTP/1.0
+ */
+static bool client_keep_alive(const req_t *req) {
+    const char *names[] = {"Connection", "Proxy-Connection"};
+    bool keep = strcmp(req->version, "HTTP/1.1") == 0;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char *value = req_header(req, names[i]);
+        if (value == NULL)
+            continue;
+        if (header_has_token(value, "close"))
+            return false;
+        if (header_has_token(value, "keep-alive"))
+            keep = true;
     }
+    return keep;
+}
 
-    if (parser_retrieve(parser, URI, &uri) == 0) {
-        printf("URI: %s\n", uri);
-    } else {
-        fprintf(stderr, "Failed to retrieve URI\n");
+/*
+ * head_parse - parse the response head at the start of a segmented object
+ * of size bytes. Only the first segment is looked at, so a head longer than
+ * SEGMENT_SIZE does not parse and its object is sent as stored.
+ */
+static bool head_parse(const segbuf_t *data, size_t size, resp_head_t *head) {
+    size_t first = size < SEGMENT_SIZE ? size : SEGMENT_SIZE;
+    return size > 0 && response_head_parse(data->segs[0], first, head) &&
+           !head->hop_headers;
+}
+
+/*
+ * send_cached - write a cached response, announcing whether the connection
+ * stays open. Stored heads carry no Connection header, so one is inserted
+ * before the blank line. The head, the header and the first segments of the
+ * body go out in one sendmsg(). Returns whether the connection can be
+ * reused.
+ */
+static bool send_cached(int connfd, cache_node_t *node, bool keep_alive) {
+    resp_head_t head;
+    const segbuf_t *data = &node->data;
+
+    if (!head_parse(data, node->size, &head)) {
+        // Not framed by us: send as stored and let the stored head govern
+        send_segments(connfd, data, 0, node->size, NULL, 0);
+        return false;
     }
 
-    if (parser_retrieve(parser, HOST, &host) == 0) {
-        printf("Host: %s\n", host);
+    keep_alive = keep_alive && head.content_length >= 0 &&
+                 (size_t)head.content_length == node->size - head.head_len;
+    const char *conn = keep_alive ? conn_keep_alive : conn_close;
+    struct iovec iov[SEGMENT_IOVS + 2] = {
+        {data->segs[0], head.head_len - 2},
+        {(void *)conn, strlen(conn)},
+    };
+    size_t body = node->size - head.head_len;
+    int iovcnt = SEGMENT_IOVS;
+    size_t n = segbuf_iov(data, head.head_len, body, iov + 2, &iovcnt);
+    if (sendv_all(connfd, iov, iovcnt + 2, n < body ? MSG_MORE : 0) < 0 ||
+        send_segments(connfd, data, head.head_len + n, body - n, NULL, 0) <
+            0)
+        return false;
+    return keep_alive;
+}
+
+/*
+ * send_filling - stream an object that another request is still fetching,
+ * framed like send_cached(). Body bytes are sent as soon as the fetcher has
+ * appended them. start is when the request arrived, for the first-byte
+ * latency. Returns whether the connection can be reused.
+ */
+static bool send_filling(int connfd, flight_t *flight, bool keep_alive,
+                         uint64_t start) {
+    resp_head_t head;
+    const segbuf_t *data = &flight->fill->data;
+    size_t offset = flight->head_len;
+    bool ok;
+
+    if (!head_parse(data, offset, &head)) {
+        ok = send_segments(connfd, data, 0, offset, NULL, 0) == 0;
+        keep_alive = false;
     } else {
-        fprintf(stderr, "Failed to retrieve HOST\n");
+        keep_alive = keep_alive && head.content_length >= 0 &&
+                     (size_t)head.content_length == flight->size - offset;
+        const char *conn = keep_alive ? conn_keep_alive : conn_close;
+        ok = send_segments(connfd, data, 0, offset - 2, conn, 0) == 0;
     }
+    stats_record(HIST_TTFB, stats_now_us() - start);
 
-    if (parser_retrieve(parser, HTTP_VERSION, &http_version) == 0) {
-        printf("HTTP Version: %s\n", http_version);
-    } else {
-        fprintf(stderr, "Failed to retrieve HTTP_VERSION\n");
+    while (ok && offset < flight->size) {
+        ssize_t filled = flight_wait(flight, offset);
+        if (filled < 0) {
+            // The fetch failed midway, the client sees a short body
+            return false;
+        }
+        ok = send_segments(connfd, data, offset, filled - offset, NULL, 0) ==
+             0;
+        offset = filled;
+    }
+    return ok && keep_alive;
+}
+
+/*
+ * serve_request - handle one HTTP request/response transaction on a client
+ * connection. Returns whether the connection can carry another request.
+ */
+static bool serve_request(client_info *client, client_input *in) {
+    // Drop the previous request's head, keeping any pipelined bytes
+    in->len -= in->used;
+    memmove(in->data, in->data + in->used, in->len);
+    in->used = 0;
+
+    // Read until the head is complete, parsing each read in place
+    req_t req;
+    req_status parsed;
+    req_init(&req);
+    while ((parsed = req_parse(&req, in->data, in->len)) == REQ_INCOMPLETE) {
+        if (in->len == sizeof(in->data)) {
+            log_warn("Request head too large\n");
+            return false;
+        }
+        ssize_t n = read(client->connfd, in->data + in->len,
+                         sizeof(in->data) - in->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n == 0) {
+            // EOF: Normal between requests, an error inside one
+            if (in->len > 0) {
+                log_warn("Client closed the connection before sending the "
+                         "complete request\n");
+            }
+            return false;
+        } else if (n < 0) {
+            // Idle timeout between requests, or error during read
+            if (in->len > 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                log_warn("Error reading from client socket\n");
+            }
+            return false;
+        }
+        in->len += n;
     }
+    if (parsed == REQ_UNSUPPORTED) {
+        send_501_not_implemented(client->connfd);
+        return false;
+    }
+    if (parsed == REQ_ERROR) {
+        log_warn("Malformed request\n");
+        return false;
+    }
+    in->used = req.head_len;
+    uint64_t start = stats_now_us();
 
+    const char *method = req.method;
+    const char *uri = req.uri;
+    const char *host = req.host;
     // Default to port 80 if no port is specified in the Host
-    if (parser_retrieve(parser, PORT, &port) != 0) {
-        port = "80";
+    const char *port = req.port != NULL ? req.port : "80";
+    log_debug("Method: %s\n", method);
+    log_debug("URI: %s\n", uri);
+    log_debug("Host: %s\n", host);
+    log_debug("HTTP Version: %s\n", req.version);
+
+    bool keep_alive = idle_timeout > 0 && client_keep_alive(&req);
+
+    // The stats page is answered by the proxy itself, also when asked for
+    // by an absolute URI naming the proxy. Any other request for the proxy
+    // would come straight back to it.
+    bool json;
+    bool self = request_for_proxy(&req, client->connfd);
+    if (stats_is_request(self ? req.path : uri, &json)) {
+        size_t len;
+        char *page = stats_response(json, &len);
+        if (page != NULL) {
+            rio_writen(client->connfd, page, len);
+            free(page);
+        }
+        return false;
+    }
+    if (self) {
+        log_warn("Request loops back to the proxy: %s\n", uri);
+        return false;
     }
 
-    // Check whether the result is already in cache
-    void *cached_data = NULL;
-    int cached_size = 0;
+    // Check whether the result is already in cache. Concurrent misses on the
+    // same URI are coalesced: if another request is already fetching it,
+    // this one streams the object as it fills. Otherwise a miss makes this
+    // request the fetcher (flight set), and it must finish the flight on
+    // every path below.
+    cache_node_t *cached = NULL;
+    flight_t *flight = NULL;
+    cache_lookup_t lookup = cache_lookup(uri, &cached, &flight);
+    if (lookup == CACHE_JOIN) {
+        cache_count(true, flight->size);
+        keep_alive = send_filling(client->connfd, flight, keep_alive, start);
+        flight_leave(flight);
+        stats_record(HIST_TOTAL, stats_now_us() - start);
+        log_info("Served from in-flight fetch: %s\n", uri);
+        return keep_alive;
+    }
+    // A stale copy is revalidated upstream if it has validators, unless the
+    // client's request is conditional itself; otherwise it is fetched again
+    // in full and the new copy replaces it
+    cache_node_t *stale = NULL;
+    if (lookup == CACHE_HIT && !cache_node_fresh(cached)) {
+        if ((cached->etag != NULL || cached->last_modified != NULL) &&
+            !request_conditional(&req)) {
+            stale = cached;
+        } else {
+            put_cache_node(cached);
+        }
+        cached = NULL;
+        lookup = CACHE_MISS;
+    }
+    if (lookup == CACHE_HIT) {
+        // Step 4: Serve the cached response to the client. The node is
+        // pinned, so it is written without holding the cache lock.
+        cache_count(true, cached->size);
+        keep_alive = send_cached(client->connfd, cached, keep_alive);
+        put_cache_node(cached);
+        uint64_t elapsed = stats_now_us() - start;
+        stats_record(HIST_TTFB, elapsed);
+        stats_record(HIST_TOTAL, elapsed);
+        log_info("Served from cache: %s\n", uri);
+        return keep_alive;
+    }
 
-    if (get_cache_node(uri, &cached_data, &cached_size) == 0 &&
-        strcmp(method, "GET") == 0) {
-        // Step 4: Serve the cached response to the client
-        rio_writen(client->connfd, cached_data, cached_size);
-        printf("Served from cache: %s\n", uri);
-        close(client->connfd);
-        free(client);
-        return NULL;
+    // Step 5 (prepared first so it can be resent): render the request with
+    // the client's hop-by-hop headers replaced by our own
+    const char *upstream_headers = conn_pool_enabled()
+                                       ? UPSTREAM_KEEP_ALIVE_HEADERS
+                                       : UPSTREAM_CONNECTION_HEADERS;
+    char *conditional = NULL;
+    if (stale != NULL &&
+        (conditional = revalidation_headers(stale, upstream_headers)) ==
+            NULL) {
+        put_cache_node(stale);
+        stale = NULL;
+    }
+    size_t reqlen;
+    char *request = request_build(
+        &req, conditional != NULL ? conditional : upstream_headers, &reqlen);
+    free(conditional);
+    if (request == NULL) {
+        log_warn("Failed to build upstream request\n");
+        if (flight)
+            flight_finish(flight, false);
+        if (stale)
+            put_cache_node(stale);
+        return false;
     }
-    fflush(stdout);
 
-    // Step 4: Establish connection with remote server based on client request
-    // Connect to the remote server using open_clientfd
+    // Step 4: Establish connection with remote server based on client
+    // request, reusing an idle pooled connection to the same origin first.
+    // New connections resolve the host through the DNS cache.
+    // A pooled socket can still be closed by the server just after its
+    // health check, so a request that gets no status line on a reused socket
+    // is retried once on a fresh connection.
     int serverfd;
-    serverfd = open_clientfd(host, port);
-    if (serverfd < 0) {
-        fprintf(stderr, "Failed to connect to remote server: %s:%s\n", host,
-                port);
-        parser_free(parser);
+    bool reused;
+    rio_t server_rio;
+    char buf[MAXLINE];
+    ssize_t n;
+    for (int attempt = 0;; attempt++) {
+        serverfd = attempt == 0 ? conn_pool_get(host, port) : -1;
+        reused = serverfd >= 0;
+        if (!reused) {
+            uint64_t connect_start = stats_now_us();
+            serverfd = dns_connect(host, port);
+            if (serverfd >= 0) {
+                socket_nodelay(serverfd);
+                stats_add(STAT_CONNECTS, 1);
+                stats_record(HIST_CONNECT, stats_now_us() - connect_start);
+            }
+        }
+        if (serverfd < 0) {
+            log_warn("Failed to connect to remote server: %s:%s\n", host,
+                     port);
+            free(request);
+            if (flight)
+                flight_finish(flight, false);
+            if (stale)
+                put_cache_node(stale);
+            return false;
+        }
+
+        // Step 5: Forward the request, then wait for the status line
+        rio_readinitb(&server_rio, serverfd);
+        if (rio_writen(serverfd, request, reqlen) >= 0 &&
+            (n = rio_readlineb(&server_rio, buf, MAXLINE)) > 0) {
+            break;
+        }
         close(serverfd);
-        close(client->connfd);
-        return NULL;
+        if (!reused) {
+            log_warn("Lost server connection\n");
+            free(request);
+            if (flight)
+                flight_finish(flight, false);
+            if (stale)
+                put_cache_node(stale);
+            return false;
+        }
     }
+    free(request);
 
-    // Step 5: Forward the request to the remote server
-    rio_t server_rio;
-    rio_readinitb(&server_rio, serverfd);
+    // Step 6: Read the response head, dropping the server's hop-by-hop
+    // headers, and relay it with our own Connection header. The copy kept
+    // for the cache grows with the response, up to max_object_size.
+    objbuf_t obj = {{NULL, 0, 0}, 0};
+    size_t total_size = 0;
+    long content_length = -1;
+    int minor = 0;
+    int status = 0;
+    bool server_keep = false;
+    bool no_store = false;
+    bool ok = true;
 
-    // Forward the parsed request line
-    snprintf(buf, MAXLINE, "%s %s HTTP/1.0\r\n", method, uri);
-    if (rio_writen(serverfd, buf, strlen(buf)) < 0) {
-        fprintf(stderr, "Lost server connection\n");
-        close(serverfd);
-        close(client->connfd);
-        parser_free(parser);
-        return NULL;
+    // When revalidating, the headers of a 304 are applied over those of the
+    // stale copy to find its new lifetime
+    resp_fresh_t fresh;
+    response_fresh_init(&fresh);
+    if (stale != NULL) {
+        response_stored_fresh(stale, &fresh);
     }
 
-    // Forward each header
-    const char *header_name = NULL;
-    const char *header_value = NULL;
-    header_t *header;
+    do {
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
+            break;
+        }
+        if (stale != NULL && total_size > 0) {
+            response_fresh_line(buf, &fresh);
+        }
+        if (total_size == 0) {
+            // Status line: HTTP/1.1 servers keep connections by default
+            sscanf(buf, "HTTP/1.%d %d", &minor, &status);
+            server_keep = minor == 1;
+        } else if (response_line_is_hop(buf, &content_length)) {
+            if (strncasecmp(buf, "Connection:", 11) == 0) {
+                if (header_has_token(buf + 11, "close")) {
+                    server_keep = false;
+                } else if (header_has_token(buf + 11, "keep-alive")) {
+                    server_keep = true;
+                }
+            }
+            continue;
+        } else if (strncasecmp(buf, "Cache-Control:", 14) == 0 &&
+                   header_has_token(buf + 14, "no-store")) {
+            no_store = true;
+        }
+        if (!objbuf_append(&obj, buf, n)) {
+            log_warn("Response head too large\n");
+            ok = false;
+            break;
+        }
+        total_size += n;
+    } while ((n = rio_readlineb(&server_rio, buf, MAXLINE)) > 0);
+    if (n <= 0) {
+        ok = false;
+    }
 
-    while ((header = parser_retrieve_next_header(parser)) != NULL) {
-        header_name = header->name;
-        header_value = header->value;
-        snprintf(buf, MAXLINE, "%s: %s\r\n", header_name, header_value);
-        if (rio_writen(serverfd, buf, strlen(buf)) < 0) {
-            fprintf(stderr, "Lost server connection\n");
-            close(serverfd);
-            close(client->connfd);
-            parser_free(parser);
-            return NULL;
+    if (stale != NULL) {
+        if (ok && status == 304) {
+            // Step 6a: The stale copy is still current. Extend its lifetime
+            // and serve it; the origin sent no body.
+            objbuf_free(&obj);
+            cache_node_refresh(stale, response_expiry(&fresh, time(NULL)));
+            if (server_keep && server_rio.rio_cnt == 0) {
+                conn_pool_put(host, port, serverfd);
+            } else {
+                close(serverfd);
+            }
+            cache_count(true, stale->size);
+            keep_alive = send_cached(client->connfd, stale, keep_alive);
+            put_cache_node(stale);
+            uint64_t elapsed = stats_now_us() - start;
+            stats_record(HIST_TTFB, elapsed);
+            stats_record(HIST_TOTAL, elapsed);
+            log_info("Revalidated cached response for: %s\n", uri);
+            return keep_alive;
         }
+        // The object changed: the full response below replaces the copy
+        put_cache_node(stale);
     }
 
-    // End headers with an empty line
-    snprintf(buf, MAXLINE, "\r\n");
-    if (rio_writen(serverfd, buf, strlen(buf)) < 0) {
-        close(serverfd);
-        parser_free(parser);
-        return NULL;
+    // Responses that never carry a body end with their head
+    long body_length = content_length;
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        body_length = 0;
     }
+    keep_alive = keep_alive && body_length >= 0;
 
-    // Step 6: Read the response from the server and relay it back to client
-    ssize_t n;
-    char response[MAX_OBJECT_SIZE];
-    char *response_ptr = response;
-    int total_size = 0;
+    if (ok) {
+        // If body bytes arrived with the head they are written next, so
+        // hold the head back to share their segment
+        const char *conn = keep_alive ? conn_keep_alive : conn_close;
+        int flags = body_length != 0 && server_rio.rio_cnt > 0 ? MSG_MORE : 0;
+        if (send_segments(client->connfd, &obj.buf, 0, total_size, conn,
+                          flags) < 0) {
+            ok = false;
+        }
+        stats_record(HIST_TTFB, stats_now_us() - start);
+        // The cached copy ends its head with a bare blank line
+        objbuf_append(&obj, "\r\n", 2);
+        total_size += 2;
+    }
+    size_t head_size = total_size;
+
+    // Only a 200 to an unconditional request is the object itself; other
+    // responses, no-store ones included, are not shared with joined
+    // requests either
+    bool storable = response_storable(&req, status, no_store);
 
-    while ((n = rio_readnb(&server_rio, buf, CHUNK_SIZE)) > 0) {
-        if (rio_writen(client->connfd, buf, n) < 0) {
+    // An object known to fit is filled in place, so concurrent requests for
+    // the same URI can stream it while the body is still arriving. The fill
+    // takes over the head's segments.
+    bool filling = flight && ok && storable && body_length >= 0 &&
+                   objbuf_cacheable(&obj) &&
+                   (size_t)body_length < max_object_size - head_size &&
+                   flight_begin_fill(flight, &obj.buf, head_size + body_length);
+    bool client_ok = ok;
+
+    // Relay the body back to the client. With a known length, stop at the
+    // end of the body so the upstream connection can be reused.
+    long remaining = body_length;
+    while (ok && remaining != 0) {
+        // Once the object can no longer be cached, stop copying it: the rest
+        // of the body moves socket to socket
+        if (!filling && (total_size >= max_object_size ||
+                         (remaining > 0 &&
+                          total_size + remaining >= max_object_size))) {
+            long moved;
+            if (splice_relay(&server_rio, client->connfd, remaining, &moved) <
+                0) {
+                log_warn("Error relaying response body\n");
+                ok = false;
+            }
+            total_size += moved;
+            if (remaining > 0) {
+                remaining -= moved;
+            }
+            break;
+        }
+
+        size_t want = CHUNK_SIZE;
+        if (remaining > 0 && remaining < CHUNK_SIZE) {
+            want = remaining;
+        }
+        n = rio_readnb(&server_rio, buf, want);
+        if (n < 0) {
+            log_warn("Lost server connection\n");
+            ok = false;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        if (remaining > 0) {
+            remaining -= n;
+        }
+
+        if (client_ok && rio_writen(client->connfd, buf, n) < 0) {
             // Client closed connection while server is sending data
             // Handle possible SIGPIPE issue and cleanup
-            fprintf(stderr,
-                    "Client closed connection while sending response\n");
-            break;
+            log_warn("Client closed connection while sending response\n");
+            client_ok = false;
+            if (!filling) {
+                ok = false;
+                break;
+            }
+            // Others stream from this fill, so finish the download
         }
 
         total_size += n;
 
-        // Only copy data when total_size < MAX
-        if (total_size <= MAX_OBJECT_SIZE) {
-            memcpy(response_ptr, buf, n);
-            response_ptr += n;
+        // Only copy data while the object can still be cached
+        if (filling) {
+            flight_append(flight, buf, n);
+        } else {
+            objbuf_append(&obj, buf, n);
         }
     }
+    bool complete = ok && (remaining == 0 || body_length < 0);
+    stats_record(HIST_TOTAL, stats_now_us() - start);
+
+    bool cacheable = complete && storable && total_size < max_object_size &&
+                     objbuf_cacheable(&obj);
+    if (complete) {
+        cache_count(false, total_size);
+    }
+    bool stored = false;
+    if (filling) {
+        // Cache the filled object and hand it to the joined requests
+        stored = flight_finish(flight, complete);
+    } else if (flight) {
+        // Length only known at the end: publish the object in one piece
+        stored = flight_finish(
+            flight,
+            cacheable && flight_begin_fill(flight, &obj.buf, total_size));
+    } else if (cacheable) {
+        stored = add_cache_node(uri, &obj.buf);
+    }
+    objbuf_free(&obj);
+    if (stored) {
+        log_info("Cached response for: %s\n", uri);
+    }
+
+    // Return the upstream connection to the pool if it is positioned at the
+    // start of the next response
+    if (complete && server_keep && body_length >= 0 &&
+        server_rio.rio_cnt == 0) {
+        conn_pool_put(host, port, serverfd);
+    } else {
+        close(serverfd);
+    }
+
+    // The client can only find the end of the body by its Content-Length
+    return complete && client_ok && keep_alive &&
+           total_size - head_size == (size_t)body_length;
+}
+
+/*
+ * serve - handle the HTTP transactions on one client connection, keeping it
+ * open between requests while both sides allow it. The caller closes
+ * client->connfd.
+ */
+void serve(client_info *client) {
+    // Read buffer shared by every request on the connection
+    client_input in;
+    in.len = 0;
+    in.used = 0;
+    socket_nodelay(client->connfd);
+
+    // Bound how long a worker waits for the next request
+    if (idle_timeout > 0) {
+        struct timeval tv = {.tv_sec = idle_timeout, .tv_usec = 0};
+        setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    while (serve_request(client, &in))
+        ;
+}
 
-    if ((total_size < MAX_OBJECT_SIZE) && (method = "GET")) {
-        add_cache_node(uri, response, total_size);
-        printf("Cached response for: %s\n", uri);
+/*
+ * worker - pooled thread that serves queued connections until the process
+ * exits
+ */
+void *worker(void *vargp) {
+    while (1) {
+        client_info *client = sbuf_remove(&conn_queue);
+        serve(client);
+        close(client->connfd);
+        free(client);
     }
+    return NULL;
+}
+
+/*
+ * save_snapshot - write the cache to the snapshot file, reporting the result
+ */
+static void save_snapshot(void) {
+    long long saved = cache_snapshot_save(snapshot_file);
+    if (saved < 0)
+        log_error("Failed to save cache snapshot: %s\n", snapshot_file);
+    else
+        log_info("Saved %lld cached objects to %s\n", saved, snapshot_file);
+}
+
+/*
+ * signal_waiter - handle the proxy's control signals. SIGUSR1 prints the
+ * cache's object and byte hit ratios to stderr. With a snapshot file,
+ * SIGUSR2 saves the cache to it, and SIGTERM and SIGINT save it before
+ * exiting. The signals are blocked in all other threads.
+ */
+static void *signal_waiter(void *vargp) {
+    sigset_t *set = vargp;
+    int sig;
 
-    close(serverfd);
-    close(client->connfd);
-    free(client);
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGUSR2) {
+            save_snapshot();
+            continue;
+        }
+        if (sig == SIGTERM || sig == SIGINT) {
+            save_snapshot();
+            exit(0);
+        }
+        cache_stats_t st;
+        cache_get_stats(&st);
+        fprintf(stderr,
+                "Cache: %lld requests, %lld hits, object hit ratio %.3f, "
+                "byte hit ratio %.3f\n",
+                st.requests, st.hits,
+                st.requests ? (double)st.hits / st.requests : 0.0,
+                st.bytes ? (double)st.hit_bytes / st.bytes : 0.0);
+    }
     return NULL;
 }
 
+/*
+ * parse_size - parse a byte count with an optional k, m or g suffix, e.g.
+ * "512k" or "4g". Returns 0 if s is not a valid size.
+ */
+static size_t parse_size(const char *s) {
+    char *end;
+    if (!isdigit((unsigned char)*s))
+        return 0;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno != 0)
+        return 0;
+
+    int shift = 0;
+    switch (tolower((unsigned char)*end)) {
+    case 'k':
+        shift = 10;
+        end++;
+        break;
+    case 'm':
+        shift = 20;
+        end++;
+        break;
+    case 'g':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || n > (SIZE_MAX >> shift))
+        return 0;
+    return (size_t)n << shift;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-e thread|epoll|uring] [-t threads] [-q queue_depth] "
+            "[-k idle_timeout] [-c upstream_per_host] [-d disk_cache_dir] "
+            "[-b disk_budget_mb] [-p lru|clock|s3fifo|gdsf] [-a] "
+            "[-H hosts_file] [-T dns_ttl] [-R] [-L log_file] "
+            "[-S snapshot_file] [-M cache_size] [-O object_size] <port>\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     int listenfd;
+    int nworkers = DEFAULT_WORKERS;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    int pool_per_host = DEFAULT_POOL_PER_HOST;
+    const char *engine = "thread";
+    const char *disk_dir = NULL;
+    long long disk_budget_mb = DEFAULT_DISK_BUDGET_MB;
+    const char *policy = "lru";
+    bool admission = false;
+    const char *hosts_file = NULL;
+    int dns_ttl = DEFAULT_DNS_TTL;
+    bool reverse_dns = false;
+    const char *log_file = NULL;
+    int opt;
     // Register sigpipe_handler
     signal(SIGPIPE, sigpipe_handler);
-    // Initialize cache
-    init_cache();
     // char buffer[BUFFER_SIZE];
     printf("%s", header_user_agent);
 
     // Initialize the proxy
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
+    while ((opt = getopt(argc, argv, "e:t:q:k:c:d:b:p:aH:T:RL:S:M:O:")) != -1) {
+        switch (opt) {
+        case 'e':
+            engine = optarg;
+            break;
+        case 't':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'k':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'c':
+            pool_per_host = atoi(optarg);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'b':
+            disk_budget_mb = atoll(optarg);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'a':
+            admission = true;
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'T':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'R':
+            reverse_dns = true;
+            break;
+        case 'L':
+            log_file = optarg;
+            break;
+        case 'S':
+            snapshot_file = optarg;
+            break;
+        case 'M':
+            max_cache_size = parse_size(optarg);
+            break;
+        case 'O':
+            max_object_size = parse_size(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nworkers <= 0 || queue_depth <= 0 ||
+        idle_timeout < 0 || pool_per_host < 0 || disk_budget_mb <= 0 ||
+        dns_ttl <= 0 || max_cache_size == 0 || max_object_size == 0) {
+        usage(argv[0]);
+    }
+    // Each shard gets an equal slice of the cache, which must still be able
+    // to hold one object
+    if (max_object_size > max_cache_size / CACHE_SHARDS) {
+        fprintf(stderr,
+                "Object size must not exceed 1/%d of the cache size\n",
+                CACHE_SHARDS);
+        exit(1);
+    }
+    if (strcmp(engine, "thread") != 0 && strcmp(engine, "epoll") != 0 &&
+        strcmp(engine, "uring") != 0) {
+        usage(argv[0]);
+    }
+    const char *port_str = argv[optind];
+    // Request logging goes through a background writer from here on
+    if (log_init(log_file) < 0) {
+        fprintf(stderr, "Failed to start logging to %s\n",
+                log_file != NULL ? log_file : "stdout");
+        exit(1);
     }
+    // Initialize cache
+    if (cache_set_policy(policy, admission) < 0) {
+        usage(argv[0]);
+    }
+    init_cache();
 
-    int port = atoi(argv[1]); // Convert the command line argument to an integer
+    // Warm restart: serve the previous run's objects from the start
+    if (snapshot_file != NULL) {
+        long long loaded = cache_snapshot_load(snapshot_file);
+        if (loaded >= 0)
+            log_info("Loaded %lld cached objects from %s\n", loaded,
+                     snapshot_file);
+    }
+
+    // Report hit ratios on SIGUSR1 and save snapshots on SIGUSR2 and at
+    // shutdown. Block the signals before any other thread starts so they
+    // all inherit the mask.
+    static sigset_t control_signals;
+    sigemptyset(&control_signals);
+    sigaddset(&control_signals, SIGUSR1);
+    if (snapshot_file != NULL) {
+        sigaddset(&control_signals, SIGUSR2);
+        sigaddset(&control_signals, SIGTERM);
+        sigaddset(&control_signals, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &control_signals, NULL);
+    pthread_t signal_tid;
+    if (pthread_create(&signal_tid, NULL, signal_waiter, &control_signals) ==
+        0) {
+        pthread_detach(signal_tid);
+    }
+    conn_pool_init(pool_per_host);
+    if (disk_dir != NULL &&
+        disk_cache_init(disk_dir, disk_budget_mb * 1024 * 1024) < 0) {
+        fprintf(stderr, "Failed to open disk cache directory: %s\n",
+                disk_dir);
+        exit(1);
+    }
+    if (dns_cache_init(hosts_file, dns_ttl) < 0) {
+        fprintf(stderr, "Failed to read hosts file: %s\n", hosts_file);
+        exit(1);
+    }
+
+    listen_port = atoi(port_str); // Convert the command line argument
 
-    if (port <= 0) {
-        fprintf(stderr, "Invalid port number: %d\n", port);
+    if (listen_port <= 0) {
+        fprintf(stderr, "Invalid port number: %d\n", listen_port);
         return 1;
     }
 
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(port_str);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", port_str);
         exit(1);
     }
 
+    // Event-driven engines: one loop per core, no worker pool
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nloops = ncpus > 0 ? (int)ncpus : 1;
+    if (strcmp(engine, "epoll") == 0) {
+        epoll_engine_run(listenfd, nloops);
+        exit(1);
+    }
+    if (strcmp(engine, "uring") == 0 &&
+        uring_engine_run(listenfd, nloops) < 0) {
+        fprintf(stderr, "io_uring unavailable, using the thread engine\n");
+    }
+
+    // Pre-spawn the worker pool fed by the connection queue
+    if (sbuf_init(&conn_queue, queue_depth) < 0) {
+        perror("sbuf_init");
+        exit(1);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
     // Accept connect request from clients continuously
     while (1) {
-        /* Allocate space on the stack for client info */
+        // Back off while the queue is full: pending connections stay in the
+        // kernel's listen backlog instead of piling up in the proxy
+        sbuf_wait_slot(&conn_queue);
+
+        /* Allocate space on the heap for client info */
         client_info *client = malloc(sizeof(client_info));
         if (client == NULL) {
-            perror("malloc");
+            log_warn("malloc: %s\n", strerror(errno));
             continue;
         }
 
@@ -330,31 +1105,37 @@ int main(int argc, char **argv) {
         client->connfd =
             accept(listenfd, (SA *)&client->addr, &client->addrlen);
         if (client->connfd < 0) {
-            perror("accept");
+            log_warn("accept: %s\n", strerror(errno));
+            free(client);
             continue;
         }
 
-        // Update client info, and print out
+        // Update client info, and print out. The address is formatted
+        // numerically: a reverse lookup here would tie the accept rate to
+        // the resolver, so with -R names come from the DNS cache, which
+        // looks up new addresses in the background.
         int res = getnameinfo((SA *)&client->addr, client->addrlen,
                               client->host, sizeof(client->host), client->serv,
-                              sizeof(client->serv), 0);
-        if (res == 0) {
-            printf("Accepted connection from %s:%s\n", client->host,
-                   client->serv);
+                              sizeof(client->serv),
+                              NI_NUMERICHOST | NI_NUMERICSERV);
+        char name[NI_MAXHOST];
+        if (res != 0) {
+            log_warn("getnameinfo failed: %s\n", gai_strerror(res));
+        } else if (reverse_dns && dns_reverse((SA *)&client->addr,
+                                              client->addrlen, name,
+                                              sizeof(name))) {
+            log_info("Accepted connection from %s (%s):%s\n", name,
+                     client->host, client->serv);
         } else {
-            fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+            log_info("Accepted connection from %s:%s\n", client->host,
+                     client->serv);
         }
 
-        // Create a new thread to handle the client connection
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, serve, client) != 0) {
-            perror("pthread_create");
-            free(client); // Free memory if thread creation fails
-            close(client->connfd);
-            continue;
-        }
-        pthread_detach(tid);
+        // Hand the connection to the worker pool
+        sbuf_insert(&conn_queue, client);
     }
     free_cache();
+    disk_cache_free();
+    dns_cache_free();
     return 0;
 }
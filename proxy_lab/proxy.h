@@ -1,7 +1,21 @@
 #ifndef PROXY_H
 #define PROXY_H
 
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
+#include <stddef.h>
+
+#define DEFAULT_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_OBJECT_SIZE (100 * 1024)
+#define CHUNK_SIZE 4096
+
+// Byte budget of the whole cache and size of the largest cached object, set
+// from the command line before the cache starts
+extern size_t max_cache_size;
+extern size_t max_object_size;
+
+// Port the proxy listens on, set before any request is served
+extern int listen_port;
+
+// Canned reply for request methods the proxy does not implement
+extern const char response_501[];
 
 #endif
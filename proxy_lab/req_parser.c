@@ -0,0 +1,268 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REQ_X86
+#endif
+
+#include "req_parser.h"
+
+#define NO_COLON SIZE_MAX
+
+// Index of the first a or b in p[0..n), or n if neither occurs
+static size_t find2_scalar(const char *p, size_t n, char a, char b) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == a || p[i] == b)
+            return i;
+    }
+    return n;
+}
+
+#ifdef __SSE2__
+// 16 bytes per step: compare against both bytes, then take the first match
+// from the movemask
+static size_t find2_sse2(const char *p, size_t n, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find2_scalar(p + i, n - i, a, b);
+}
+#endif
+
+#ifdef REQ_X86
+// Same as find2_sse2() with 32 bytes per step, for CPUs that have AVX2
+__attribute__((target("avx2"))) static size_t
+find2_avx2(const char *p, size_t n, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find2_scalar(p + i, n - i, a, b);
+}
+#endif
+
+static size_t find2(const char *p, size_t n, char a, char b) {
+#ifdef REQ_X86
+    if (n >= 32 && __builtin_cpu_supports("avx2"))
+        return find2_avx2(p, n, a, b);
+#endif
+#ifdef __SSE2__
+    return find2_sse2(p, n, a, b);
+#else
+    return find2_scalar(p, n, a, b);
+#endif
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static req_span_t span(size_t off, size_t len) {
+    return (req_span_t){(uint32_t)off, (uint32_t)len};
+}
+
+// Split "method SP target SP version" in buf[start..end)
+static bool parse_request_line(req_t *req, const char *buf, size_t start,
+                               size_t end) {
+    const char *p = buf + start;
+    const char *e = buf + end;
+    const char *sp1 = memchr(p, ' ', e - p);
+    if (sp1 == NULL || sp1 == p)
+        return false;
+    const char *u = sp1 + 1;
+    const char *sp2 = memchr(u, ' ', e - u);
+    if (sp2 == NULL || sp2 == u || sp2 + 1 == e ||
+        memchr(sp2 + 1, ' ', e - sp2 - 1) != NULL)
+        return false;
+
+    req->method_span = span(start, sp1 - p);
+    req->uri_span = span(u - buf, sp2 - u);
+    req->version_span = span(sp2 + 1 - buf, e - sp2 - 1);
+    return true;
+}
+
+// Record "name: value" in buf[start..end), whose first ':' is at colon
+static bool parse_header_line(req_t *req, const char *buf, size_t start,
+                              size_t end, size_t colon) {
+    if (colon == NO_COLON || colon >= end || is_blank(buf[start]) ||
+        req->nheaders == REQ_MAX_HEADERS)
+        return false;
+
+    size_t name_end = colon;
+    while (name_end > start && is_blank(buf[name_end - 1]))
+        name_end--;
+    if (name_end == start)
+        return false;
+    size_t value = colon + 1;
+    while (value < end && is_blank(buf[value]))
+        value++;
+    size_t value_end = end;
+    while (value_end > value && is_blank(buf[value_end - 1]))
+        value_end--;
+
+    req->names[req->nheaders] = span(start, name_end - start);
+    req->values[req->nheaders] = span(value, value_end - value);
+    req->nheaders++;
+    return true;
+}
+
+// Split "host[:port]" into the request's host and port. The host may be a
+// bracketed IPv6 literal.
+static bool split_authority(req_t *req, const char *s, size_t n) {
+    const char *host = s;
+    const char *port = NULL;
+    size_t hlen;
+    size_t plen = 0;
+
+    if (n > 0 && s[0] == '[') {
+        const char *close = memchr(s, ']', n);
+        if (close == NULL)
+            return false;
+        host = s + 1;
+        hlen = close - host;
+        if (close + 1 < s + n) {
+            if (close[1] != ':')
+                return false;
+            port = close + 2;
+        }
+    } else {
+        const char *c = memchr(s, ':', n);
+        hlen = c != NULL ? (size_t)(c - s) : n;
+        if (c != NULL)
+            port = c + 1;
+    }
+    if (port != NULL)
+        plen = s + n - port;
+    if (hlen == 0 || hlen >= REQ_HOST_LEN || plen >= REQ_PORT_LEN)
+        return false;
+
+    memcpy(req->hostbuf, host, hlen);
+    req->hostbuf[hlen] = '\0';
+    req->host = req->hostbuf;
+    req->port = NULL;
+    if (plen > 0) {
+        memcpy(req->portbuf, port, plen);
+        req->portbuf[plen] = '\0';
+        req->port = req->portbuf;
+    }
+    return true;
+}
+
+// The blank line arrived: terminate every field in place and find the
+// upstream, from an absolute URI or else from the Host header
+static req_status finish(req_t *req, char *buf, size_t head_len) {
+    req->head_len = head_len;
+    req->method = buf + req->method_span.off;
+    buf[req->method_span.off + req->method_span.len] = '\0';
+    req->uri = buf + req->uri_span.off;
+    buf[req->uri_span.off + req->uri_span.len] = '\0';
+    req->version = buf + req->version_span.off;
+    buf[req->version_span.off + req->version_span.len] = '\0';
+    for (int i = 0; i < req->nheaders; i++) {
+        req->headers[i].name = buf + req->names[i].off;
+        buf[req->names[i].off + req->names[i].len] = '\0';
+        req->headers[i].value = buf + req->values[i].off;
+        buf[req->values[i].off + req->values[i].len] = '\0';
+    }
+
+    const char *scheme = strstr(req->uri, "://");
+    if (scheme != NULL && scheme != req->uri &&
+        strcspn(req->uri, ":/?#") == (size_t)(scheme - req->uri)) {
+        const char *authority = scheme + 3;
+        size_t n = strcspn(authority, "/?#");
+        if (!split_authority(req, authority, n))
+            return REQ_ERROR;
+        req->path = authority + n;
+        return REQ_COMPLETE;
+    }
+    req->path = req->uri;
+    const char *host = req_header(req, "Host");
+    if (host == NULL || !split_authority(req, host, strlen(host)))
+        return REQ_ERROR;
+    return REQ_COMPLETE;
+}
+
+void req_init(req_t *req) {
+    req->scanned = 0;
+    req->line = 0;
+    req->colon = NO_COLON;
+    req->nlines = 0;
+    req->nheaders = 0;
+    req->host = NULL;
+    req->port = NULL;
+}
+
+// Scan the bytes of buf[0..len) not seen by earlier calls. The buffer must
+// hold the whole head from its first byte; later reads are appended to it.
+// On REQ_COMPLETE the fields point into buf, which is modified, and bytes
+// after head_len belong to the next request.
+req_status req_parse(req_t *req, char *buf, size_t len) {
+    size_t pos = req->scanned;
+
+    while (pos < len) {
+        // Header lines are scanned for their first ':' on the way
+        bool want_colon = req->nlines > 0 && req->colon == NO_COLON;
+        size_t i = pos + find2(buf + pos, len - pos, want_colon ? ':' : '\n',
+                               '\n');
+        if (i == len) {
+            pos = len;
+            break;
+        }
+        pos = i + 1;
+        if (buf[i] == ':') {
+            req->colon = i;
+            continue;
+        }
+
+        size_t end = i;
+        if (end > req->line && buf[end - 1] == '\r')
+            end--;
+        if (end == req->line) {
+            // Blank line: the end of the head, or noise before the request
+            if (req->nlines > 0)
+                return finish(req, buf, pos);
+        } else if (req->nlines == 0) {
+            if (!parse_request_line(req, buf, req->line, end))
+                return REQ_ERROR;
+            // Only GET is proxied; say so before requiring a Host
+            if (req->method_span.len != 3 ||
+                memcmp(buf + req->line, "GET", 3) != 0)
+                return REQ_UNSUPPORTED;
+            req->nlines++;
+        } else {
+            if (!parse_header_line(req, buf, req->line, end, req->colon))
+                return REQ_ERROR;
+            req->nlines++;
+        }
+        req->line = pos;
+        req->colon = NO_COLON;
+    }
+    req->scanned = pos;
+    return REQ_INCOMPLETE;
+}
+
+// Value of the first header called name, ignoring case, or NULL
+const char *req_header(const req_t *req, const char *name) {
+    for (int i = 0; i < req->nheaders; i++) {
+        if (strcasecmp(req->headers[i].name, name) == 0)
+            return req->headers[i].value;
+    }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef REQ_PARSER_H
+#define REQ_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental request head parser working in place on the read buffer.
+// Line ends and header colons are found with SIMD scans, and fields are kept
+// as offsets until the blank line arrives. Then they become NUL-terminated
+// strings inside the buffer; only the upstream host and port are copied.
+#define REQ_MAX_HEADERS 64
+#define REQ_HOST_LEN 256
+#define REQ_PORT_LEN 8
+
+typedef enum {
+    REQ_INCOMPLETE, // Need more bytes
+    REQ_COMPLETE,   // Saw the blank line ending the headers
+    REQ_ERROR,      // Malformed or oversized request
+    REQ_UNSUPPORTED, // Method other than GET, known from the request line
+} req_status;
+
+typedef struct {
+    const char *name;  // Inside the read buffer
+    const char *value; // Inside the read buffer, surrounding blanks removed
+} req_header_t;
+
+// A field of the head while it is incomplete
+typedef struct {
+    uint32_t off; // Offset in the read buffer
+    uint32_t len; // Length, the byte after it becomes the NUL
+} req_span_t;
+
+typedef struct {
+    // Scanner state, kept across partial reads
+    size_t scanned; // Bytes of the buffer already scanned
+    size_t line;    // Offset of the line being scanned
+    size_t colon;   // Offset of that line's first ':', SIZE_MAX if none yet
+    int nlines;     // Complete lines seen, the request line included
+    req_span_t method_span;
+    req_span_t uri_span;
+    req_span_t version_span;
+    req_span_t names[REQ_MAX_HEADERS];
+    req_span_t values[REQ_MAX_HEADERS];
+
+    // Results, set when req_parse() returns REQ_COMPLETE
+    size_t head_len;     // Bytes up to and including the blank line
+    const char *method;  // Request method
+    const char *uri;     // Request target as sent, the cache key
+    const char *path;    // uri without any scheme and authority
+    const char *version; // e.g. "HTTP/1.1"
+    const char *host;    // Upstream host, from the URI or the Host header
+    const char *port;    // Upstream port, NULL if none was given
+    int nheaders;        // Number of headers
+    req_header_t headers[REQ_MAX_HEADERS]; // Headers in request order
+    char hostbuf[REQ_HOST_LEN];
+    char portbuf[REQ_PORT_LEN];
+} req_t;
+
+void req_init(req_t *req);
+req_status req_parse(req_t *req, char *buf, size_t len);
+const char *req_header(const req_t *req, const char *name);
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+
+#include "sbuf.h"
+
+// Create an empty queue holding at most capacity items
+int sbuf_init(sbuf_t *sp, int capacity) {
+    sp->buf = calloc(capacity, sizeof(void *));
+    if (sp->buf == NULL)
+        return -1;
+    sp->capacity = capacity;
+    sp->front = 0;
+    sp->count = 0;
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->not_empty, NULL);
+    pthread_cond_init(&sp->not_full, NULL);
+    return 0;
+}
+
+// Release the queue's storage
+void sbuf_deinit(sbuf_t *sp) {
+    free(sp->buf);
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->not_empty);
+    pthread_cond_destroy(&sp->not_full);
+}
+
+// Block until the queue has a free slot. With a single producer the slot is
+// still free at the next sbuf_insert(), so the accept loop can call this to
+// stop accepting while every worker is busy and the queue is full.
+void sbuf_wait_slot(sbuf_t *sp) {
+    pthread_mutex_lock(&sp->lock);
+    while (sp->count == sp->capacity) {
+        pthread_cond_wait(&sp->not_full, &sp->lock);
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
+
+// Append an item, blocking while the queue is full
+void sbuf_insert(sbuf_t *sp, void *item) {
+    pthread_mutex_lock(&sp->lock);
+    while (sp->count == sp->capacity) {
+        pthread_cond_wait(&sp->not_full, &sp->lock);
+    }
+    sp->buf[(sp->front + sp->count) % sp->capacity] = item;
+    sp->count++;
+    pthread_cond_signal(&sp->not_empty);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+// Remove and return the oldest item, blocking while the queue is empty
+void *sbuf_remove(sbuf_t *sp) {
+    pthread_mutex_lock(&sp->lock);
+    while (sp->count == 0) {
+        pthread_cond_wait(&sp->not_empty, &sp->lock);
+    }
+    void *item = sp->buf[sp->front];
+    sp->front = (sp->front + 1) % sp->capacity;
+    sp->count--;
+    pthread_cond_signal(&sp->not_full);
+    pthread_mutex_unlock(&sp->lock);
+    return item;
+}
@@ -0,0 +1,24 @@
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <pthread.h>
+
+// Bounded FIFO of pointers shared by one producer (the accept loop) and the
+// worker threads, guarded by a mutex and two condition variables.
+typedef struct {
+    void **buf;              // Ring of queued items
+    int capacity;            // Maximum number of queued items
+    int front;               // Index of the oldest item
+    int count;               // Number of queued items
+    pthread_mutex_t lock;    // Protects every field above
+    pthread_cond_t not_empty; // Signalled when an item is inserted
+    pthread_cond_t not_full;  // Signalled when an item is removed
+} sbuf_t;
+
+int sbuf_init(sbuf_t *sp, int capacity);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_wait_slot(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, void *item);
+void *sbuf_remove(sbuf_t *sp);
+
+#endif
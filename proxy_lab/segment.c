@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "segment.h"
+
+#define SEGMENT_KEEP (SEGMENT_KEEP_BYTES / SEGMENT_SIZE)
+
+// Free segments, linked through their first bytes
+typedef struct free_segment {
+    struct free_segment *next;
+} free_segment_t;
+
+static free_segment_t *free_list;
+static size_t nfree;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *segment_alloc(void) {
+    pthread_mutex_lock(&pool_lock);
+    free_segment_t *seg = free_list;
+    if (seg != NULL) {
+        free_list = seg->next;
+        nfree--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return seg != NULL ? (char *)seg : malloc(SEGMENT_SIZE);
+}
+
+// Return a segment to the pool, or to malloc() once the pool keeps
+// SEGMENT_KEEP_BYTES
+static void segment_free(char *ptr) {
+    free_segment_t *seg = (free_segment_t *)ptr;
+    pthread_mutex_lock(&pool_lock);
+    if (nfree < SEGMENT_KEEP) {
+        seg->next = free_list;
+        free_list = seg;
+        nfree++;
+        seg = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(seg);
+}
+
+// Slots in a segment array of n segments: arrays grow by doubling
+static size_t segs_slots(size_t n) {
+    return n <= 1 ? n : (size_t)1 << (64 - __builtin_clzll(n - 1));
+}
+
+// Make room for size bytes of data, adding segments as needed. len is left
+// alone. Returns false if memory ran out, keeping the segments added so far.
+bool segbuf_reserve(segbuf_t *sb, size_t size) {
+    size_t need = (size + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT;
+    if (need <= sb->nsegs)
+        return true;
+
+    if (need > segs_slots(sb->nsegs)) {
+        char **segs = realloc(sb->segs, segs_slots(need) * sizeof(char *));
+        if (segs == NULL)
+            return false;
+        sb->segs = segs;
+    }
+    while (sb->nsegs < need) {
+        char *seg = segment_alloc();
+        if (seg == NULL)
+            return false;
+        sb->segs[sb->nsegs++] = seg;
+    }
+    return true;
+}
+
+// Copy n bytes to off, which the caller has reserved room for
+void segbuf_write(segbuf_t *sb, size_t off, const void *data, size_t n) {
+    const char *src = data;
+    while (n > 0) {
+        size_t in = off & (SEGMENT_SIZE - 1);
+        size_t chunk = SEGMENT_SIZE - in < n ? SEGMENT_SIZE - in : n;
+        memcpy(sb->segs[off >> SEGMENT_SHIFT] + in, src, chunk);
+        src += chunk;
+        off += chunk;
+        n -= chunk;
+    }
+}
+
+// Append n bytes after the data. Returns false if memory ran out.
+bool segbuf_append(segbuf_t *sb, const void *data, size_t n) {
+    if (!segbuf_reserve(sb, sb->len + n))
+        return false;
+    segbuf_write(sb, sb->len, data, n);
+    sb->len += n;
+    return true;
+}
+
+// Describe len bytes from off with at most *iovcnt iovecs, one per segment
+// touched. Stores the number used in *iovcnt and returns the bytes they
+// cover, which is less than len if the iovecs ran out.
+size_t segbuf_iov(const segbuf_t *sb, size_t off, size_t len,
+                  struct iovec *iov, int *iovcnt) {
+    size_t covered = 0;
+    int n = 0;
+    while (covered < len && n < *iovcnt) {
+        size_t pos = off + covered;
+        size_t in = pos & (SEGMENT_SIZE - 1);
+        size_t chunk = SEGMENT_SIZE - in;
+        if (chunk > len - covered)
+            chunk = len - covered;
+        iov[n].iov_base = sb->segs[pos >> SEGMENT_SHIFT] + in;
+        iov[n].iov_len = chunk;
+        n++;
+        covered += chunk;
+    }
+    *iovcnt = n;
+    return covered;
+}
+
+// Return every segment to the pool and empty the buffer
+void segbuf_free(segbuf_t *sb) {
+    for (size_t i = 0; i < sb->nsegs; i++) {
+        segment_free(sb->segs[i]);
+    }
+    free(sb->segs);
+    sb->segs = NULL;
+    sb->nsegs = 0;
+    sb->len = 0;
+}
+
+// Release every free segment back to malloc()
+void segment_trim(void) {
+    pthread_mutex_lock(&pool_lock);
+    free_segment_t *seg = free_list;
+    free_list = NULL;
+    nfree = 0;
+    pthread_mutex_unlock(&pool_lock);
+    while (seg != NULL) {
+        free_segment_t *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Cached bodies are stored as chains of fixed-size segments from a shared
+// pool instead of one contiguous block, so objects of any size up to
+// max_object_size cost no large allocation and freed memory is reused as is
+// by the next object whatever its size. Segments are sent with writev().
+#define SEGMENT_SHIFT 14
+#define SEGMENT_SIZE (1 << SEGMENT_SHIFT)
+
+// Bytes of free segments the pool keeps for reuse
+#define SEGMENT_KEEP_BYTES (16 * 1024 * 1024)
+
+// Most iovecs gathered into one send
+#define SEGMENT_IOVS 64
+
+typedef struct {
+    char **segs;  // Segments in order, each SEGMENT_SIZE bytes
+    size_t nsegs; // Number of segments
+    size_t len;   // Bytes of data, from the start of the first segment
+} segbuf_t;
+
+bool segbuf_reserve(segbuf_t *sb, size_t size);
+bool segbuf_append(segbuf_t *sb, const void *data, size_t n);
+void segbuf_write(segbuf_t *sb, size_t off, const void *data, size_t n);
+size_t segbuf_iov(const segbuf_t *sb, size_t off, size_t len,
+                  struct iovec *iov, int *iovcnt);
+void segbuf_free(segbuf_t *sb);
+void segment_trim(void);
+
+#endif
@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+// Header in front of every block, recording where to return it
+typedef union slab_block {
+    struct {
+        int cls;                 // Size class, -1 for a malloc'd block
+        union slab_block *next;  // Next free block of the class
+    };
+    max_align_t align;
+} slab_block_t;
+
+typedef struct {
+    size_t size;          // Usable bytes of each block
+    size_t keep;          // Free blocks kept at most
+    slab_block_t *free;   // Free blocks of this class
+    size_t nfree;         // Number of free blocks
+    pthread_mutex_t lock; // Protects this class only
+} slab_class_t;
+
+static slab_class_t classes[SLAB_CLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+static void init_classes(void) {
+    classes[0].size = SLAB_MIN;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (i > 0) {
+            size_t base = (size_t)1 << (SLAB_MIN_SHIFT + (i - 1) / 4);
+            classes[i].size = base + ((i - 1) % 4 + 1) * (base >> 2);
+        }
+        classes[i].keep = SLAB_KEEP_BYTES / classes[i].size;
+        if (classes[i].keep == 0)
+            classes[i].keep = 1;
+        classes[i].free = NULL;
+        classes[i].nfree = 0;
+        pthread_mutex_init(&classes[i].lock, NULL);
+    }
+}
+
+// Map a size to its class and the class's block size. Above SLAB_MIN each
+// power of two is split into four classes, so a block wastes at most a fifth
+// of its bytes.
+static int size_class(size_t size, size_t *block) {
+    if (size <= SLAB_MIN) {
+        *block = SLAB_MIN;
+        return 0;
+    }
+    int lg = 63 - __builtin_clzll(size - 1); // 2^lg < size <= 2^(lg + 1)
+    size_t base = (size_t)1 << lg;
+    size_t step = base >> 2;
+    size_t quarter = (size - 1 - base) / step;
+    *block = base + (quarter + 1) * step;
+    return (lg - SLAB_MIN_SHIFT) * 4 + (int)quarter + 1;
+}
+
+// Allocate at least size bytes
+void *slab_alloc(size_t size) {
+    pthread_once(&classes_once, init_classes);
+
+    slab_block_t *b;
+    if (size > SLAB_MAX) {
+        b = malloc(sizeof(slab_block_t) + size);
+        if (b == NULL)
+            return NULL;
+        b->cls = -1;
+        return b + 1;
+    }
+
+    size_t block;
+    int cls = size_class(size, &block);
+    slab_class_t *c = &classes[cls];
+    pthread_mutex_lock(&c->lock);
+    b = c->free;
+    if (b != NULL) {
+        c->free = b->next;
+        c->nfree--;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (b == NULL && (b = malloc(sizeof(slab_block_t) + block)) == NULL)
+        return NULL;
+    b->cls = cls;
+    return b + 1;
+}
+
+// Return a block to its class, or to malloc() once the class already keeps
+// SLAB_KEEP_BYTES of free blocks
+void slab_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    slab_block_t *b = (slab_block_t *)ptr - 1;
+    if (b->cls < 0) {
+        free(b);
+        return;
+    }
+
+    slab_class_t *c = &classes[b->cls];
+    pthread_mutex_lock(&c->lock);
+    if (c->nfree < c->keep) {
+        b->next = c->free;
+        c->free = b;
+        c->nfree++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(b);
+}
+
+// Release every free block back to malloc()
+void slab_trim(void) {
+    pthread_once(&classes_once, init_classes);
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_class_t *c = &classes[i];
+        pthread_mutex_lock(&c->lock);
+        slab_block_t *b = c->free;
+        c->free = NULL;
+        c->nfree = 0;
+        pthread_mutex_unlock(&c->lock);
+        while (b != NULL) {
+            slab_block_t *next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Size-classed allocator for cache objects. Classes step by a quarter of a
+// power of two from SLAB_MIN to SLAB_MAX; freed blocks go back to a per-class
+// free list and are reused by the next allocation of the same class.
+// Larger requests fall through to malloc().
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 18
+#define SLAB_MIN (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX (1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES ((SLAB_MAX_SHIFT - SLAB_MIN_SHIFT) * 4 + 1)
+
+// Bytes of free blocks each class keeps for reuse
+#define SLAB_KEEP_BYTES (256 * 1024)
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+void slab_trim(void);
+
+#endif
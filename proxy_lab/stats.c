@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+// One thread's counters. Only the owning thread writes them, with plain
+// relaxed stores, so updates never contend; readers may see a slightly old
+// value.
+typedef struct stats_local {
+    _Atomic uint64_t counters[STAT_COUNTERS];
+    _Atomic uint64_t buckets[STAT_HISTS][STATS_BUCKETS];
+    _Atomic uint64_t sums[STAT_HISTS]; // Sum of recorded values
+    _Atomic uint64_t maxes[STAT_HISTS]; // Largest recorded value
+    struct stats_local *next;           // Next registered thread
+} stats_local_t;
+
+static const char *const counter_names[STAT_COUNTERS] = {
+    "hits", "misses", "bytes", "hit_bytes", "evictions", "upstream_connects"};
+static const char *const hist_names[STAT_HISTS] = {"connect_us", "ttfb_us",
+                                                   "total_us"};
+
+// Every thread that ever recorded something; entries are never freed since
+// the proxy's threads live as long as the process
+static stats_local_t *all_locals;
+static pthread_mutex_t locals_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_local_t *local;
+
+// The calling thread's counters, registered on first use. NULL if out of
+// memory, in which case the update is dropped.
+static stats_local_t *get_local(void) {
+    if (local == NULL && (local = calloc(1, sizeof(stats_local_t))) != NULL) {
+        pthread_mutex_lock(&locals_lock);
+        local->next = all_locals;
+        all_locals = local;
+        pthread_mutex_unlock(&locals_lock);
+    }
+    return local;
+}
+
+// Single-writer increment: no lock prefix needed
+static inline void bump(_Atomic uint64_t *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static size_t bucket_index(uint64_t v) {
+    if (v < (1u << STATS_SUB_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    size_t sub = (v >> (e - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1);
+    return ((size_t)(e - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+// Smallest value that falls in bucket i
+static uint64_t bucket_value(size_t i) {
+    if (i < (1u << STATS_SUB_BITS))
+        return i;
+    int e = (i >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = i & ((1u << STATS_SUB_BITS) - 1);
+    return ((1ull << STATS_SUB_BITS) + sub) << (e - STATS_SUB_BITS);
+}
+
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_add(stats_counter_t counter, uint64_t n) {
+    stats_local_t *l = get_local();
+    if (l != NULL)
+        bump(&l->counters[counter], n);
+}
+
+void stats_record(stats_hist_t hist, uint64_t usec) {
+    stats_local_t *l = get_local();
+    if (l == NULL)
+        return;
+    bump(&l->buckets[hist][bucket_index(usec)], 1);
+    bump(&l->sums[hist], usec);
+    if (usec > atomic_load_explicit(&l->maxes[hist], memory_order_relaxed))
+        atomic_store_explicit(&l->maxes[hist], usec, memory_order_relaxed);
+}
+
+// Sum a counter over every thread
+uint64_t stats_get(stats_counter_t counter) {
+    uint64_t total = 0;
+    pthread_mutex_lock(&locals_lock);
+    for (stats_local_t *l = all_locals; l != NULL; l = l->next) {
+        total += atomic_load_explicit(&l->counters[counter],
+                                      memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&locals_lock);
+    return total;
+}
+
+// Whether uri asks for the stats page, and in which format:
+// STATS_URI for text, STATS_URI "?format=json" for JSON
+bool stats_is_request(const char *uri, bool *json) {
+    size_t n = strlen(STATS_URI);
+    if (strncmp(uri, STATS_URI, n) != 0)
+        return false;
+    *json = strcmp(uri + n, "?format=json") == 0;
+    return uri[n] == '\0' || *json;
+}
+
+// A histogram summed over every thread, caller holds locals_lock
+typedef struct {
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} hist_sum_t;
+
+static void sum_hist(stats_hist_t h, hist_sum_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (stats_local_t *l = all_locals; l != NULL; l = l->next) {
+        for (size_t i = 0; i < STATS_BUCKETS; i++) {
+            uint64_t c =
+                atomic_load_explicit(&l->buckets[h][i], memory_order_relaxed);
+            out->buckets[i] += c;
+            out->count += c;
+        }
+        out->sum += atomic_load_explicit(&l->sums[h], memory_order_relaxed);
+        uint64_t max =
+            atomic_load_explicit(&l->maxes[h], memory_order_relaxed);
+        if (max > out->max)
+            out->max = max;
+    }
+}
+
+// Lower bound of the bucket holding the q-quantile
+static uint64_t quantile(const hist_sum_t *hs, double q) {
+    if (hs->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * (hs->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += hs->buckets[i];
+        if (seen >= rank)
+            return bucket_value(i);
+    }
+    return hs->max;
+}
+
+// Append to a growable string, silently truncating on allocation failure
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+static void sb_printf(strbuf_t *sb, const char *fmt, ...) {
+    va_list ap;
+    while (sb->data != NULL) {
+        va_start(ap, fmt);
+        int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < sb->cap - sb->len) {
+            sb->len += n;
+            return;
+        }
+        char *grown = realloc(sb->data, sb->cap * 2);
+        if (grown == NULL)
+            return;
+        sb->data = grown;
+        sb->cap *= 2;
+    }
+}
+
+// Render every counter and histogram summed over all threads as a complete
+// HTTP response: "name value" lines, or one JSON object. Returns a malloc'd
+// string of *len bytes, or NULL.
+char *stats_response(bool json, size_t *len) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *const qnames[] = {"p50", "p90", "p99", "p999"};
+    uint64_t counters[STAT_COUNTERS];
+    hist_sum_t *hists = malloc(STAT_HISTS * sizeof(hist_sum_t));
+    strbuf_t sb = {malloc(4096), 0, 4096};
+    if (hists == NULL || sb.data == NULL) {
+        free(hists);
+        free(sb.data);
+        return NULL;
+    }
+
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        counters[c] = stats_get(c);
+    }
+    pthread_mutex_lock(&locals_lock);
+    for (int h = 0; h < STAT_HISTS; h++) {
+        sum_hist(h, &hists[h]);
+    }
+    pthread_mutex_unlock(&locals_lock);
+
+    uint64_t requests = counters[STAT_HITS] + counters[STAT_MISSES];
+    double hit_ratio =
+        requests ? (double)counters[STAT_HITS] / requests : 0.0;
+    double byte_hit_ratio =
+        counters[STAT_BYTES]
+            ? (double)counters[STAT_HIT_BYTES] / counters[STAT_BYTES]
+            : 0.0;
+
+    if (json)
+        sb_printf(&sb, "{");
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        sb_printf(&sb, json ? "\"%s\":%llu," : "%s %llu\n", counter_names[c],
+                  (unsigned long long)counters[c]);
+    }
+    sb_printf(&sb, json ? "\"hit_ratio\":%.4f,\"byte_hit_ratio\":%.4f"
+                        : "hit_ratio %.4f\nbyte_hit_ratio %.4f\n",
+              hit_ratio, byte_hit_ratio);
+    for (int h = 0; h < STAT_HISTS; h++) {
+        const hist_sum_t *hs = &hists[h];
+        uint64_t mean = hs->count ? hs->sum / hs->count : 0;
+        sb_printf(&sb, json ? ",\"%s\":{\"count\":%llu,\"mean\":%llu"
+                            : "%s count=%llu mean=%llu",
+                  hist_names[h], (unsigned long long)hs->count,
+                  (unsigned long long)mean);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]);
+             q++) {
+            sb_printf(&sb, json ? ",\"%s\":%llu" : " %s=%llu", qnames[q],
+                      (unsigned long long)quantile(hs, quantiles[q]));
+        }
+        sb_printf(&sb, json ? ",\"max\":%llu}" : " max=%llu\n",
+                  (unsigned long long)hs->max);
+    }
+    if (json)
+        sb_printf(&sb, "}\n");
+    free(hists);
+
+    // Prepend the head now that the body's length is known
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Cache-Control: no-store\r\n"
+                            "Connection: close\r\n\r\n",
+                            json ? "application/json" : "text/plain",
+                            sb.len);
+    char *out = malloc(head_len + sb.len);
+    if (out != NULL) {
+        memcpy(out, head, head_len);
+        memcpy(out + head_len, sb.data, sb.len);
+        *len = head_len + sb.len;
+    }
+    free(sb.data);
+    return out;
+}
@@ -0,0 +1,42 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Proxy-wide counters and latency histograms. Each thread updates its own
+// copy without locks or atomic read-modify-writes; readers sum them.
+#define STATS_URI "/__proxy_stats"
+
+// Histograms are log-linear like HdrHistogram: values below
+// 2^STATS_SUB_BITS microseconds are exact, larger ones fall in one of
+// 2^STATS_SUB_BITS buckets per power of two (about 6% wide)
+#define STATS_SUB_BITS 4
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+typedef enum {
+    STAT_HITS,      // Requests served from the cache or an in-flight fetch
+    STAT_MISSES,    // Cacheable requests fetched from the origin
+    STAT_BYTES,     // Response bytes of hits and misses
+    STAT_HIT_BYTES, // Response bytes served from the cache
+    STAT_EVICTIONS, // Objects evicted from memory to make room
+    STAT_CONNECTS,  // New upstream connections
+    STAT_COUNTERS
+} stats_counter_t;
+
+typedef enum {
+    HIST_CONNECT, // Upstream connect time, name lookup included
+    HIST_TTFB,    // Request head parsed to first response byte sent
+    HIST_TOTAL,   // Request head parsed to last response byte sent
+    STAT_HISTS
+} stats_hist_t;
+
+uint64_t stats_now_us(void);
+void stats_add(stats_counter_t counter, uint64_t n);
+void stats_record(stats_hist_t hist, uint64_t usec);
+uint64_t stats_get(stats_counter_t counter);
+bool stats_is_request(const char *uri, bool *json);
+char *stats_response(bool json, size_t *len);
+
+#endif
@@ -0,0 +1,890 @@
+/*
+ * io_uring engine for the proxy. Each loop thread owns a ring and keeps
+ * exactly one operation in flight per connection (accept, recv, connect or
+ * send). Completions for many connections are reaped together, and every
+ * operation they queue goes to the kernel in the next io_uring_enter(), so
+ * one syscall covers a whole batch of socket operations.
+ *
+ *   RECV_REQUEST -> (hit or 501) SEND_CLIENT -> close
+ *   RECV_REQUEST -> CONNECT -> SEND_REQUEST -> RECV_HEAD -> RELAY_CLIENT
+ *   RELAY_CLIENT <-> RECV_SERVER
+ *   RELAY_CLIENT -> (too large to cache) SPLICE_IN <-> SPLICE_OUT
+ *
+ * A request whose upstream name is not in the DNS cache waits in RESOLVE,
+ * with nothing in flight, until a poll on the loop's eventfd completes.
+ *
+ * Shared with serve(): the request parser, the forwarded request, the
+ * rewritten and stored response head, the cache.c lookups and inserts, and
+ * revalidation of stale hits. Not supported here: keep-alive with clients
+ * (every connection serves one request), the upstream connection pool (each
+ * miss connects afresh and reads to EOF), request coalescing through
+ * flights, and the client idle timeout.
+ *
+ * The ring is driven through the raw system calls, so no liburing is needed.
+ */
+
+#define _GNU_SOURCE // pipe2(), SPLICE_F_MOVE
+
+#include "uring_engine.h"
+#include "cache.h"
+#include "csapp.h"
+#include "dns_cache.h"
+#include "engine_common.h"
+#include "log.h"
+#include "proxy.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define ACCEPT_TAG 0 // user_data of the accept operation
+#define WAKE_TAG 1   // user_data of the poll on the DNS eventfd
+#define SPLICE_CHUNK (64 * 1024) // Bytes moved per splice through the pipe
+
+typedef enum {
+    UC_RECV_REQUEST, // Receiving and parsing the request headers
+    UC_RESOLVE,      // Waiting for the upstream name to resolve
+    UC_SEND_CLIENT,  // Sending a canned reply or a cached object
+    UC_CONNECT,      // Connecting upstream
+    UC_SEND_REQUEST, // Forwarding the request to upstream
+    UC_RECV_HEAD,    // Receiving the upstream response head
+    UC_RECV_SERVER,  // Receiving a chunk of the upstream response
+    UC_RELAY_CLIENT, // Sending that chunk on to the client
+    UC_SPLICE_IN,    // Splicing upstream bytes into the pipe
+    UC_SPLICE_OUT,   // Splicing them from the pipe to the client
+} uconn_state;
+
+typedef struct uconn uconn_t;
+
+struct uconn {
+    uconn_state state;
+    int clientfd;                 // Client socket
+    int serverfd;                 // Upstream socket, -1 until connecting
+    req_t req;                    // Request parsed in place in inbuf
+    char inbuf[MAXLINE];          // Request bytes received so far
+    size_t inlen;                 // Number of bytes in inbuf
+    const char *wptr;             // Pending bytes of the current send
+    size_t wlen;                  // Number of pending bytes at wptr
+    char *reqbuf;                 // Request forwarded upstream
+    char *relay;                  // Relay buffer; holds the response head
+                                  // first, RESPONSE_HEAD_MAX bytes
+    size_t relay_len;             // Bytes of the head received into relay
+    relay_head_t head;            // The response head, rewritten for the
+                                  // client
+    cache_node_t *cached;         // Pinned cache node being sent, if any
+    cache_node_t *stale;          // Pinned stale node being revalidated
+    bool revalidated;             // cached is a stale node the origin
+                                  // confirmed
+    size_t sent;                  // Bytes of the cached node sent so far
+    struct iovec iov[SEGMENT_IOVS]; // Segments of the cached node in flight
+    struct msghdr msg;            // IORING_OP_SENDMSG header for iov
+    char *uri;                    // Cache key of the request
+    objbuf_t obj;                 // Copy of the response for the cache
+    uint64_t start;               // When the request head was parsed, in us
+    uint64_t connect_at;          // When the upstream connect began, in us
+    dns_addrs_t addrs;            // Upstream addresses, tried in order
+    int next_addr;                // Next address of addrs to try
+    int pipefd[2];                // Splice pipe, -1 until the body outgrows
+                                  // the cache
+    size_t piped;                 // Bytes in the pipe not yet sent
+    uconn_t *next_parked;         // Link in the loop's RESOLVE list
+};
+
+typedef struct {
+    int fd;                     // Ring file descriptor
+    unsigned *sq_head;          // Kernel-owned SQ head
+    unsigned *sq_tail;          // Our SQ tail
+    unsigned *sq_mask;          // SQ index mask
+    unsigned *sq_array;         // SQ index array
+    unsigned sq_entries;        // Number of SQ entries
+    struct io_uring_sqe *sqes;  // Submission entries
+    unsigned *cq_head;          // Our CQ head
+    unsigned *cq_tail;          // Kernel-owned CQ tail
+    unsigned *cq_mask;          // CQ index mask
+    struct io_uring_cqe *cqes;  // Completion entries
+    unsigned pending;           // SQEs queued since the last submit
+    void *sq_map;               // SQ ring mapping, MAP_FAILED if none
+    size_t sq_len;
+    void *cq_map;               // CQ ring mapping if separate, else MAP_FAILED
+    size_t cq_len;
+    size_t sqes_len;            // Length of the sqes mapping
+} uring_t;
+
+// Whether the kernel supports IORING_OP_SPLICE, found by uring_probe()
+static bool splice_supported;
+
+typedef struct {
+    uring_t ring;     // This loop's ring
+    int listenfd;     // The shared listening socket
+    int wakefd;       // eventfd the DNS cache signals after a lookup
+    uconn_t *parked;  // Connections waiting for a name to resolve
+} uring_loop_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Check that the kernel implements every opcode the engine issues
+static int uring_probe(int fd) {
+    const int ops[] = {IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_SEND,
+                       IORING_OP_SENDMSG, IORING_OP_RECV, IORING_OP_POLL_ADD};
+    size_t len = sizeof(struct io_uring_probe) +
+                 IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL)
+        return -1;
+
+    int rc = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                                   IORING_OP_LAST);
+    for (size_t i = 0; rc == 0 && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            rc = -1;
+    }
+    // Splicing is optional: without it large bodies are copied through
+    splice_supported =
+        rc == 0 && IORING_OP_SPLICE <= probe->last_op &&
+        (probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return rc;
+}
+
+// Unmap whatever part of a ring was set up and close it
+static void uring_free(uring_t *r) {
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != MAP_FAILED)
+        munmap(r->cq_map, r->cq_len);
+    if (r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+}
+
+// Create a ring and map its queues. Returns -1 if io_uring is unavailable,
+// with nothing left open.
+static int uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->sq_map = r->cq_map = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0 || uring_probe(r->fd) < 0) {
+        uring_free(r);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_len > sq_len)
+        sq_len = cq_len;
+
+    r->sq_len = sq_len;
+    r->sq_map = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        uring_free(r);
+        return -1;
+    }
+    char *sq = r->sq_map;
+    char *cq = sq;
+    if (!single) {
+        r->cq_len = cq_len;
+        r->cq_map = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            uring_free(r);
+            return -1;
+        }
+        cq = r->cq_map;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        uring_free(r);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->pending = 0;
+    return 0;
+}
+
+// Hand queued SQEs to the kernel, optionally waiting for completions
+static int uring_submit(uring_t *r, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret = sys_io_uring_enter(r->fd, r->pending, min_complete, flags);
+    if (ret > 0)
+        r->pending -= ret;
+    return ret;
+}
+
+// Copy one SQE into the submission queue; it is submitted with the batch
+static void uring_queue(uring_t *r, const struct io_uring_sqe *sqe) {
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+           r->sq_entries) {
+        // Queue full: submit what we have to make room
+        if (uring_submit(r, 0) < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+
+    unsigned index = tail & *r->sq_mask;
+    r->sqes[index] = *sqe;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+static void queue_accept(uring_loop_t *loop) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = loop->listenfd;
+    sqe.user_data = ACCEPT_TAG;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Wait for the DNS cache to signal the loop's eventfd
+static void queue_wake(uring_loop_t *loop) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = loop->wakefd;
+    sqe.poll_events = POLLIN;
+    sqe.user_data = WAKE_TAG;
+    uring_queue(&loop->ring, &sqe);
+}
+
+static void queue_recv(uring_loop_t *loop, uconn_t *c, int fd, void *buf,
+                       size_t len) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.addr = (unsigned long)buf;
+    sqe.len = len;
+    sqe.user_data = (unsigned long)c;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Send whatever is left at c->wptr
+static void queue_send(uring_loop_t *loop, uconn_t *c, int fd) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_SEND;
+    sqe.fd = fd;
+    sqe.addr = (unsigned long)c->wptr;
+    sqe.len = c->wlen;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = (unsigned long)c;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Send the rest of the cached node, a batch of segments per sendmsg. What
+// is left of its rewritten head at c->wptr goes first.
+static void queue_send_cached(uring_loop_t *loop, uconn_t *c) {
+    const cache_node_t *node = c->cached;
+    int head = 0;
+    if (c->wlen > 0) {
+        c->iov[0] = (struct iovec){(void *)c->wptr, c->wlen};
+        head = 1;
+    }
+    int iovcnt = SEGMENT_IOVS - head;
+    segbuf_iov(&node->data, c->sent, node->size - c->sent, c->iov + head,
+               &iovcnt);
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = head + iovcnt;
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = c->clientfd;
+    sqe.addr = (unsigned long)&c->msg;
+    sqe.len = 1;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = (unsigned long)c;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Move up to len bytes from fd_in to fd_out, one of which is the pipe
+static void queue_splice(uring_loop_t *loop, uconn_t *c, int fd_in,
+                         int fd_out, size_t len) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_SPLICE;
+    sqe.fd = fd_out;
+    sqe.off = (uint64_t)-1;
+    sqe.splice_fd_in = fd_in;
+    sqe.splice_off_in = (uint64_t)-1;
+    sqe.len = len;
+    sqe.splice_flags = SPLICE_F_MOVE;
+    sqe.user_data = (unsigned long)c;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Connect to c->addrs[c->next_addr - 1], set by next_upstream()
+static void queue_connect(uring_loop_t *loop, uconn_t *c) {
+    int i = c->next_addr - 1;
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_CONNECT;
+    sqe.fd = c->serverfd;
+    sqe.addr = (unsigned long)&c->addrs.addrs[i];
+    sqe.off = c->addrs.addrlens[i];
+    sqe.user_data = (unsigned long)c;
+    uring_queue(&loop->ring, &sqe);
+}
+
+// Close both sockets and free the connection. Only called from a completion
+// handler, when the connection has no operation in flight.
+static void uconn_close(uconn_t *c) {
+    close(c->clientfd);
+    if (c->serverfd >= 0)
+        close(c->serverfd);
+    if (c->cached != NULL)
+        put_cache_node(c->cached);
+    if (c->stale != NULL)
+        put_cache_node(c->stale);
+    free(c->reqbuf);
+    free(c->relay);
+    free(c->head.out);
+    free(c->uri);
+    objbuf_free(&c->obj);
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    free(c);
+}
+
+// Start sending a reply that needs no upstream
+static void start_reply(uring_loop_t *loop, uconn_t *c, const char *data,
+                        size_t len) {
+    c->state = UC_SEND_CLIENT;
+    c->wptr = data;
+    c->wlen = len;
+    queue_send(loop, c, c->clientfd);
+}
+
+// Send the pinned node c->cached. Its stored head gets a Connection header,
+// the body follows as is.
+static void start_cached(uring_loop_t *loop, uconn_t *c) {
+    cache_count(true, c->cached->size);
+    c->reqbuf = cached_head_close(&c->cached->data, c->cached->size, &c->wlen,
+                                  &c->sent);
+    c->wptr = c->reqbuf;
+    c->state = UC_SEND_CLIENT;
+    queue_send_cached(loop, c);
+}
+
+// Create a socket for the next upstream address not tried yet, closing the
+// previous one. Returns -1 once every address has been tried.
+static int next_upstream(uconn_t *c) {
+    if (c->serverfd >= 0) {
+        close(c->serverfd);
+        c->serverfd = -1;
+    }
+    while (c->next_addr < c->addrs.naddrs) {
+        int i = c->next_addr++;
+        c->serverfd = socket(c->addrs.addrs[i].ss_family, SOCK_STREAM, 0);
+        if (c->serverfd >= 0) {
+            socket_nodelay(c->serverfd);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Resolve the upstream into c->addrs and connect to the first address. A
+// name missing from the DNS cache is left to the refresh thread, and the
+// connection parked until it is done.
+static void connect_upstream(uring_loop_t *loop, uconn_t *c) {
+    const char *host = c->req.host;
+    const char *port = c->req.port != NULL ? c->req.port : "80";
+
+    int rc = dns_lookup_async(host, port, &c->addrs);
+    if (rc == DNS_PENDING) {
+        c->state = UC_RESOLVE;
+        c->next_parked = loop->parked;
+        loop->parked = c;
+        return;
+    }
+    c->connect_at = stats_now_us();
+    c->next_addr = 0;
+    if (rc < 0 || next_upstream(c) < 0) {
+        log_warn("Failed to connect to remote server: %s:%s\n", host, port);
+        uconn_close(c);
+        return;
+    }
+    c->state = UC_CONNECT;
+    queue_connect(loop, c);
+}
+
+// A lookup finished: re-arm the poll and retry every parked connection.
+// Those whose name is still pending park again.
+static void wake_complete(uring_loop_t *loop, int res) {
+    uint64_t count;
+    if (res < 0)
+        log_warn("eventfd poll: %s\n", strerror(-res));
+    else if (read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_warn("eventfd read: %s\n", strerror(errno));
+    queue_wake(loop);
+
+    uconn_t *c = loop->parked;
+    loop->parked = NULL;
+    while (c != NULL) {
+        uconn_t *next = c->next_parked;
+        connect_upstream(loop, c);
+        c = next;
+    }
+}
+
+// The request headers are complete: answer from the cache or go upstream
+static void start_request(uring_loop_t *loop, uconn_t *c) {
+    const char *uri = c->req.uri;
+    bool json;
+    bool self = request_for_proxy(&c->req, c->clientfd);
+
+    c->start = stats_now_us();
+    if (stats_is_request(self ? c->req.path : uri, &json)) {
+        size_t len;
+        if ((c->reqbuf = stats_response(json, &len)) == NULL) {
+            uconn_close(c);
+            return;
+        }
+        start_reply(loop, c, c->reqbuf, len);
+        return;
+    }
+    if (self) {
+        log_warn("Request loops back to the proxy: %s\n", uri);
+        uconn_close(c);
+        return;
+    }
+
+    c->uri = strdup(uri);
+    if (c->uri == NULL) {
+        uconn_close(c);
+        return;
+    }
+
+    // Cache hit: send the pinned node straight from the cache. As in
+    // serve(), a stale node is revalidated upstream if it has validators,
+    // unless the client's request is conditional itself; otherwise it is
+    // fetched again in full and the new copy replaces it.
+    if ((c->cached = get_cache_node(uri)) != NULL &&
+        !cache_node_fresh(c->cached)) {
+        if ((c->cached->etag != NULL || c->cached->last_modified != NULL) &&
+            !request_conditional(&c->req))
+            c->stale = c->cached;
+        else
+            put_cache_node(c->cached);
+        c->cached = NULL;
+    }
+    if (c->cached != NULL) {
+        start_cached(loop, c);
+        return;
+    }
+
+    char *conditional = NULL;
+    if (c->stale != NULL &&
+        (conditional = revalidation_headers(
+             c->stale, UPSTREAM_CONNECTION_HEADERS)) == NULL) {
+        put_cache_node(c->stale);
+        c->stale = NULL;
+    }
+    size_t reqlen;
+    c->reqbuf = request_build(
+        &c->req,
+        conditional != NULL ? conditional : UPSTREAM_CONNECTION_HEADERS,
+        &reqlen);
+    free(conditional);
+    c->relay = malloc(RESPONSE_HEAD_MAX);
+    // The headers of a 304 are applied over those of the stale copy
+    response_fresh_init(&c->head.fresh);
+    if (c->stale != NULL)
+        response_stored_fresh(c->stale, &c->head.fresh);
+    if (c->reqbuf == NULL || c->relay == NULL) {
+        uconn_close(c);
+        return;
+    }
+    c->wptr = c->reqbuf;
+    c->wlen = reqlen;
+    connect_upstream(loop, c);
+}
+
+// Advance past res sent bytes; returns 1 once the whole buffer is out
+static int advance_send(uring_loop_t *loop, uconn_t *c, int fd, int res) {
+    c->wptr += res;
+    c->wlen -= res;
+    if (c->wlen > 0) {
+        queue_send(loop, c, fd);
+        return 0;
+    }
+    return 1;
+}
+
+// The upstream closed: the response is complete
+static void relay_done(uconn_t *c) {
+    stats_record(HIST_TOTAL, stats_now_us() - c->start);
+    cache_count(false, c->obj.len);
+    if (relay_cacheable(&c->req, &c->head, &c->obj) &&
+        add_cache_node(c->uri, &c->obj.buf))
+        log_info("Cached response for: %s\n", c->uri);
+    uconn_close(c);
+}
+
+// A relayed chunk is out: receive the next one. Once the response has
+// outgrown the cache, or is not to be stored at all, nothing needs to see
+// the bytes, so if the kernel can, the rest of the body goes socket to pipe
+// to socket with IORING_OP_SPLICE.
+static void next_relay(uring_loop_t *loop, uconn_t *c) {
+    bool storable =
+        response_storable(&c->req, c->head.status, c->head.no_store);
+    if (splice_supported && (!storable || !objbuf_cacheable(&c->obj)) &&
+        pipe2(c->pipefd, O_CLOEXEC) == 0) {
+        // Drop the copy but keep counting the response's bytes
+        size_t len = c->obj.len;
+        objbuf_free(&c->obj);
+        c->obj.len = len;
+        c->state = UC_SPLICE_IN;
+        queue_splice(loop, c, c->serverfd, c->pipefd[1], SPLICE_CHUNK);
+        return;
+    }
+    c->state = UC_RECV_SERVER;
+    queue_recv(loop, c, c->serverfd, c->relay, CHUNK_SIZE);
+}
+
+// Advance past res bytes of the cached node and its head; returns 1 once
+// all of it is out
+static int advance_cached(uring_loop_t *loop, uconn_t *c, int res) {
+    size_t head = (size_t)res < c->wlen ? (size_t)res : c->wlen;
+    c->wptr += head;
+    c->wlen -= head;
+    c->sent += res - head;
+    if (c->wlen > 0 || c->sent < c->cached->size) {
+        queue_send_cached(loop, c);
+        return 0;
+    }
+    return 1;
+}
+
+// Drive one connection forward with the result of its completed operation
+static void uconn_complete(uring_loop_t *loop, uconn_t *c, int res) {
+    switch (c->state) {
+    case UC_RESOLVE:
+        // Nothing is in flight until wake_complete()
+        break;
+    case UC_RECV_REQUEST:
+        if (res <= 0) {
+            // Client closed the connection before completing the request
+            uconn_close(c);
+            return;
+        }
+        c->inlen += res;
+        switch (req_parse(&c->req, c->inbuf, c->inlen)) {
+        case REQ_COMPLETE:
+            start_request(loop, c);
+            break;
+        case REQ_UNSUPPORTED:
+            start_reply(loop, c, response_501, strlen(response_501));
+            break;
+        case REQ_ERROR:
+            log_warn("Malformed request\n");
+            uconn_close(c);
+            break;
+        case REQ_INCOMPLETE:
+            if (c->inlen == sizeof(c->inbuf)) {
+                log_warn("Request head too large\n");
+                uconn_close(c);
+                break;
+            }
+            queue_recv(loop, c, c->clientfd, c->inbuf + c->inlen,
+                       sizeof(c->inbuf) - c->inlen);
+            break;
+        }
+        break;
+
+    case UC_SEND_CLIENT:
+        if (res < 0) {
+            uconn_close(c);
+        } else if (c->cached != NULL
+                       ? advance_cached(loop, c, res)
+                       : advance_send(loop, c, c->clientfd, res)) {
+            if (c->cached != NULL) {
+                uint64_t elapsed = stats_now_us() - c->start;
+                stats_record(HIST_TTFB, elapsed);
+                stats_record(HIST_TOTAL, elapsed);
+                log_info(c->revalidated
+                             ? "Revalidated cached response for: %s\n"
+                             : "Served from cache: %s\n",
+                         c->uri);
+            }
+            uconn_close(c);
+        }
+        break;
+
+    case UC_CONNECT:
+        if (res < 0) {
+            // Like the epoll engine, fall through to the next address
+            if (next_upstream(c) == 0) {
+                queue_connect(loop, c);
+                return;
+            }
+            log_warn("Failed to connect to remote server\n");
+            uconn_close(c);
+            return;
+        }
+        stats_add(STAT_CONNECTS, 1);
+        stats_record(HIST_CONNECT, stats_now_us() - c->connect_at);
+        c->state = UC_SEND_REQUEST;
+        queue_send(loop, c, c->serverfd);
+        break;
+
+    case UC_SEND_REQUEST:
+        if (res < 0) {
+            log_warn("Lost server connection\n");
+            uconn_close(c);
+        } else if (advance_send(loop, c, c->serverfd, res)) {
+            free(c->reqbuf);
+            c->reqbuf = NULL;
+            c->state = UC_RECV_HEAD;
+            queue_recv(loop, c, c->serverfd, c->relay, RESPONSE_HEAD_MAX);
+        }
+        break;
+
+    case UC_RECV_HEAD:
+        if (res <= 0) {
+            log_warn("Lost server connection\n");
+            uconn_close(c);
+            return;
+        }
+        c->relay_len += res;
+        switch (relay_head_parse(c->relay, c->relay_len, &c->head)) {
+        case 0:
+            queue_recv(loop, c, c->serverfd, c->relay + c->relay_len,
+                       RESPONSE_HEAD_MAX - c->relay_len);
+            return;
+        case -1:
+            log_warn("Malformed or oversized response head\n");
+            uconn_close(c);
+            return;
+        }
+        if (c->stale != NULL) {
+            if (c->head.status == 304) {
+                // The stale copy is still current: extend its lifetime and
+                // send it, the origin sent no body
+                cache_node_refresh(c->stale, response_expiry(&c->head.fresh,
+                                                             time(NULL)));
+                close(c->serverfd);
+                c->serverfd = -1;
+                c->cached = c->stale;
+                c->stale = NULL;
+                c->revalidated = true;
+                start_cached(loop, c);
+                return;
+            }
+            // The object changed: the full response replaces the copy
+            put_cache_node(c->stale);
+            c->stale = NULL;
+        }
+        // The copy for the cache starts with the stored form of the head,
+        // and the rewritten head goes to the client with any body bytes
+        // that came along
+        stats_record(HIST_TTFB, stats_now_us() - c->start);
+        relay_head_store(&c->head, &c->obj);
+        c->wptr = c->head.out;
+        c->wlen = c->head.out_len;
+        c->state = UC_RELAY_CLIENT;
+        queue_send(loop, c, c->clientfd);
+        break;
+
+    case UC_RECV_SERVER:
+        if (res < 0) {
+            log_warn("Lost server connection\n");
+            uconn_close(c);
+        } else if (res == 0) {
+            relay_done(c);
+        } else {
+            objbuf_append(&c->obj, c->relay, res);
+            c->wptr = c->relay;
+            c->wlen = res;
+            c->state = UC_RELAY_CLIENT;
+            queue_send(loop, c, c->clientfd);
+        }
+        break;
+
+    case UC_RELAY_CLIENT:
+        if (res < 0) {
+            log_warn("Client closed connection while sending response\n");
+            uconn_close(c);
+        } else if (advance_send(loop, c, c->clientfd, res)) {
+            next_relay(loop, c);
+        }
+        break;
+
+    case UC_SPLICE_IN:
+        if (res < 0) {
+            log_warn("Lost server connection\n");
+            uconn_close(c);
+        } else if (res == 0) {
+            relay_done(c);
+        } else {
+            c->obj.len += res;
+            c->piped = res;
+            c->state = UC_SPLICE_OUT;
+            queue_splice(loop, c, c->pipefd[0], c->clientfd, c->piped);
+        }
+        break;
+
+    case UC_SPLICE_OUT:
+        if (res <= 0) {
+            log_warn("Client closed connection while sending response\n");
+            uconn_close(c);
+        } else if ((c->piped -= res) > 0) {
+            queue_splice(loop, c, c->pipefd[0], c->clientfd, c->piped);
+        } else {
+            c->state = UC_SPLICE_IN;
+            queue_splice(loop, c, c->serverfd, c->pipefd[1], SPLICE_CHUNK);
+        }
+        break;
+    }
+}
+
+// A new client connected: set up its connection and re-arm accept
+static void accept_complete(uring_loop_t *loop, int res) {
+    queue_accept(loop);
+    if (res < 0) {
+        log_warn("accept: %s\n", strerror(-res));
+        return;
+    }
+
+    socket_nodelay(res);
+
+    uconn_t *c = calloc(1, sizeof(uconn_t));
+    if (c == NULL) {
+        log_warn("Failed to initialize connection\n");
+        close(res);
+        return;
+    }
+    req_init(&c->req);
+    c->state = UC_RECV_REQUEST;
+    c->clientfd = res;
+    c->serverfd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    queue_recv(loop, c, c->clientfd, c->inbuf, sizeof(c->inbuf));
+}
+
+// One ring loop: submit the batch, wait, reap every completion
+static void *uring_loop(void *vargp) {
+    uring_loop_t *loop = (uring_loop_t *)vargp;
+    uring_t *r = &loop->ring;
+
+    queue_accept(loop);
+    queue_wake(loop);
+    while (1) {
+        if (uring_submit(r, 1) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            unsigned long tag = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            // Release the slot before handling, handlers may queue more
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+            if (tag == ACCEPT_TAG)
+                accept_complete(loop, res);
+            else if (tag == WAKE_TAG)
+                wake_complete(loop, res);
+            else
+                uconn_complete(loop, (uconn_t *)tag, res);
+        }
+    }
+    return NULL;
+}
+
+// Run nloops io_uring loops on listenfd. Returns -1 without starting
+// anything if io_uring is unavailable, so the caller can fall back;
+// otherwise never returns.
+int uring_engine_run(int listenfd, int nloops) {
+    uring_loop_t *loops = calloc(nloops, sizeof(uring_loop_t));
+    if (loops == NULL)
+        return -1;
+
+    for (int i = 0; i < nloops; i++) {
+        loops[i].listenfd = listenfd;
+        if (uring_init(&loops[i].ring, URING_ENTRIES) < 0) {
+            for (int j = 0; j < i; j++)
+                uring_free(&loops[j].ring);
+            free(loops);
+            return -1;
+        }
+    }
+    for (int i = 0; i < nloops; i++) {
+        loops[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loops[i].wakefd < 0 || dns_watch(loops[i].wakefd) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+    }
+
+    log_info("io_uring engine: %d rings\n", nloops);
+    for (int i = 1; i < nloops; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, uring_loop, &loops[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    uring_loop(&loops[0]);
+    return 0;
+}
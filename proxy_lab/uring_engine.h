@@ -0,0 +1,6 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+int uring_engine_run(int listenfd, int nloops);
+
+#endif